@@ -35,6 +35,7 @@ Source: https://github.com/Disservin/chess-library
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <regex>
 #include <sstream>
@@ -415,6 +416,60 @@ struct State {
     Square enpassant;
     uint8_t half_moves;
     Piece captured_piece;
+    uint16_t plies_from_null;
+};
+
+/// @brief Stack of states, kept on the heap so that a Board stays small. Making and unmaking
+/// moves only allocates when the stack is full, at which point it doubles, and copying a
+/// board only copies the states in use, leaving HEADROOM free states for a search.
+class StateStack {
+   public:
+    static constexpr int HEADROOM = 256;
+
+    StateStack() : states_(new State[HEADROOM]), capacity_(HEADROOM) {}
+    StateStack(const StateStack &other)
+        : states_(new State[other.size_ + HEADROOM]), capacity_(other.size_ + HEADROOM), size_(other.size_) {
+        std::copy(other.states_.get(), other.states_.get() + other.size_, states_.get());
+    }
+
+    StateStack &operator=(const StateStack &other) {
+        if (this != &other) {
+            if (capacity_ < other.size_ + HEADROOM) {
+                states_.reset(new State[other.size_ + HEADROOM]);
+                capacity_ = other.size_ + HEADROOM;
+            }
+            size_ = other.size_;
+            std::copy(other.states_.get(), other.states_.get() + other.size_, states_.get());
+        }
+        return *this;
+    }
+
+    void push_back(const State &state) {
+        if (size_ == capacity_) {
+            std::unique_ptr<State[]> states(new State[capacity_ * 2]);
+            std::copy(states_.get(), states_.get() + size_, states.get());
+            states_ = std::move(states);
+            capacity_ *= 2;
+        }
+        states_[size_++] = state;
+    }
+
+    void pop_back() {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    [[nodiscard]] const State &back() const { return states_[size_ - 1]; }
+    [[nodiscard]] const State &operator[](int index) const { return states_[index]; }
+
+    [[nodiscard]] int size() const { return size_; }
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+    void clear() { size_ = 0; }
+
+   private:
+    std::unique_ptr<State[]> states_;
+    int capacity_;
+    int size_ = 0;
 };
 
 struct Move {
@@ -546,7 +601,7 @@ struct Movelist {
     [[nodiscard]] constexpr const_iterator end() const { return moves_ + size_; }
 
    private:
-    Move moves_[MAX_MOVES]{};
+    Move moves_[MAX_MOVES];
     int size_ = 0;
 };
 
@@ -1072,6 +1127,13 @@ void legalmoves(Movelist &movelist, const Board &board);
 /****************************************************************************\
  * Board                                                                     *
 \****************************************************************************/
+
+/// @brief Observer that ignores every piece change, used by the plain makeMove/unmakeMove.
+struct NoObserver {
+    void piecePlaced(Piece, Square) {}
+    void pieceRemoved(Piece, Square) {}
+};
+
 class Board {
    public:
     explicit Board(std::string fen = STARTPOS);
@@ -1081,8 +1143,25 @@ class Board {
     virtual void setFen(const std::string &fen);
     [[nodiscard]] std::string getFen() const;
 
-    void makeMove(const Move &move);
-    void unmakeMove(const Move &move);
+    void makeMove(const Move &move) {
+        NoObserver observer;
+        makeMove(move, observer);
+    }
+    void unmakeMove(const Move &move) {
+        NoObserver observer;
+        unmakeMove(move, observer);
+    }
+
+    /// @brief Makes or unmakes a move, reporting every piece placed or removed to observer
+    /// through piecePlaced(piece, sq) and pieceRemoved(piece, sq). The observer is a
+    /// template parameter, so the hooks are inlined instead of going through a vtable.
+    /// @tparam Observer
+    /// @param move
+    /// @param observer
+    template <typename Observer>
+    void makeMove(const Move &move, Observer &observer);
+    template <typename Observer>
+    void unmakeMove(const Move &move, Observer &observer);
 
     void makeNullMove();
     void unmakeNullMove();
@@ -1155,6 +1234,18 @@ class Board {
 
     [[nodiscard]] bool isRepetition(int count = 2) const;
 
+    /// @brief Checks for draws by insufficient material without generating any moves.
+    /// @return
+    [[nodiscard]] bool isInsufficientMaterial() const;
+
+    /// @brief Checks if the side to move can reach an earlier position with a single
+    /// reversible move, or if a position inside the search has already repeated.
+    /// Positions up to ply plies back are part of the search, older ones count only
+    /// if they have already occurred twice.
+    /// @param ply
+    /// @return
+    [[nodiscard]] bool hasGameCycle(int ply) const;
+
     [[nodiscard]] std::pair<GameResultReason, GameResult> isGameOver() const;
 
     /// @brief Checks if a square is attacked by the given color.
@@ -1172,10 +1263,22 @@ class Board {
     friend std::ostream &operator<<(std::ostream &os, const Board &board);
 
    protected:
-    virtual void placePiece(Piece piece, Square sq);
-    virtual void removePiece(Piece piece, Square sq);
+    void placePiece(Piece piece, Square sq);
+    void removePiece(Piece piece, Square sq);
+
+    template <typename Observer>
+    void placePiece(Piece piece, Square sq, Observer &observer) {
+        placePiece(piece, sq);
+        observer.piecePlaced(piece, sq);
+    }
 
-    std::vector<State> prev_states_;
+    template <typename Observer>
+    void removePiece(Piece piece, Square sq, Observer &observer) {
+        removePiece(piece, sq);
+        observer.pieceRemoved(piece, sq);
+    }
+
+    StateStack prev_states_;
 
     U64 pieces_bb_[2][6]{};
 
@@ -1191,6 +1294,8 @@ class Board {
     Color side_to_move_ = Color::WHITE;
     Square enpassant_sq_ = Square::NO_SQ;
     uint8_t half_moves_ = 0;
+    // Positions before a null move are not reachable from the current one
+    uint16_t plies_from_null_ = 0;
 
     bool chess960_ = false;
 
@@ -1320,7 +1425,7 @@ inline void Board::setFenInternal(std::string fen) {
     occ_all_ = all();
 
     prev_states_.clear();
-    prev_states_.reserve(150);
+    plies_from_null_ = 0;
 }
 
 inline void Board::setFen(const std::string &fen) { setFenInternal(fen); }
@@ -1467,7 +1572,7 @@ inline std::ostream &operator<<(std::ostream &os, const Board &b) {
     uint8_t c = 0;
 
     for (int i = static_cast<int>(prev_states_.size()) - 2;
-         i >= 0 && i >= static_cast<int>(prev_states_.size()) - half_moves_ - 1; i -= 2) {
+         i >= 0 && i >= static_cast<int>(prev_states_.size()) - std::min<int>(half_moves_ + 1, plies_from_null_); i -= 2) {
         if (prev_states_[i].hash == hash_key_) c++;
 
         if (c == count) return true;
@@ -1476,36 +1581,43 @@ inline std::ostream &operator<<(std::ostream &os, const Board &b) {
     return false;
 }
 
-[[nodiscard]] inline std::pair<GameResultReason, GameResult> Board::isGameOver() const {
-    if (half_moves_ >= 100) {
-        const Board &board = *this;
-
-        Movelist movelist;
-        movegen::legalmoves<MoveGenType::ALL>(movelist, board);
-        if (movelist.empty() && isAttacked(kingSq(side_to_move_), ~side_to_move_)) {
-            return {GameResultReason::CHECKMATE, GameResult::LOSE};
-        }
-        return {GameResultReason::FIFTY_MOVE_RULE, GameResult::DRAW};
-    }
-
+[[nodiscard]] inline bool Board::isInsufficientMaterial() const {
     const auto count = builtin::popcount(occ());
 
-    if (count == 2) return {GameResultReason::INSUFFICIENT_MATERIAL, GameResult::DRAW};
+    if (count == 2) return true;
 
     if (count == 3) {
         if (pieces(PieceType::BISHOP, Color::WHITE) || pieces(PieceType::BISHOP, Color::BLACK))
-            return {GameResultReason::INSUFFICIENT_MATERIAL, GameResult::DRAW};
+            return true;
         if (pieces(PieceType::KNIGHT, Color::WHITE) || pieces(PieceType::KNIGHT, Color::BLACK))
-            return {GameResultReason::INSUFFICIENT_MATERIAL, GameResult::DRAW};
+            return true;
     }
 
     if (count == 4) {
         if (pieces(PieceType::BISHOP, Color::WHITE) && pieces(PieceType::BISHOP, Color::BLACK) &&
             utils::sameColor(builtin::lsb(pieces(PieceType::BISHOP, Color::WHITE)),
                              builtin::lsb(pieces(PieceType::BISHOP, Color::BLACK))))
-            return {GameResultReason::INSUFFICIENT_MATERIAL, GameResult::DRAW};
+            return true;
     }
 
+    return false;
+}
+
+[[nodiscard]] inline std::pair<GameResultReason, GameResult> Board::isGameOver() const {
+    if (half_moves_ >= 100) {
+        const Board &board = *this;
+
+        Movelist movelist;
+        movegen::legalmoves<MoveGenType::ALL>(movelist, board);
+        if (movelist.empty() && isAttacked(kingSq(side_to_move_), ~side_to_move_)) {
+            return {GameResultReason::CHECKMATE, GameResult::LOSE};
+        }
+        return {GameResultReason::FIFTY_MOVE_RULE, GameResult::DRAW};
+    }
+
+    if (isInsufficientMaterial())
+        return {GameResultReason::INSUFFICIENT_MATERIAL, GameResult::DRAW};
+
     if (isRepetition()) return {GameResultReason::THREEFOLD_REPETITION, GameResult::DRAW};
 
     const Board &board = *this;
@@ -1560,15 +1672,17 @@ inline void Board::removePiece(Piece piece, Square sq) {
     occ_all_ &= ~(1ULL << sq);
 }
 
-inline void Board::makeMove(const Move &move) {
+template <typename Observer>
+inline void Board::makeMove(const Move &move, Observer &observer) {
     const auto capture = at(move.to()) != Piece::NONE && move.typeOf() != Move::CASTLING;
     const auto captured = at(move.to());
     const auto pt = at<PieceType>(move.from());
 
-    prev_states_.emplace_back(
-        State{hash_key_, castling_rights_, enpassant_sq_, half_moves_, captured});
+    prev_states_.push_back(
+        State{hash_key_, castling_rights_, enpassant_sq_, half_moves_, captured, plies_from_null_});
 
     half_moves_++;
+    plies_from_null_++;
     full_moves_++;
 
     if (enpassant_sq_ != NO_SQ) hash_key_ ^= zobrist::enpassant(utils::squareFile(enpassant_sq_));
@@ -1579,7 +1693,7 @@ inline void Board::makeMove(const Move &move) {
     if (capture) {
         half_moves_ = 0;
 
-        removePiece(captured, move.to());
+        removePiece(captured, move.to(), observer);
 
         const auto rank = utils::squareRank(move.to());
 
@@ -1634,29 +1748,29 @@ inline void Board::makeMove(const Move &move) {
         const auto king = at(move.from());
         const auto rook = at(move.to());
 
-        removePiece(king, move.from());
-        removePiece(rook, move.to());
+        removePiece(king, move.from(), observer);
+        removePiece(rook, move.to(), observer);
 
         assert(king == utils::makePiece(side_to_move_, PieceType::KING));
         assert(rook == utils::makePiece(side_to_move_, PieceType::ROOK));
 
-        placePiece(king, kingTo);
-        placePiece(rook, rookTo);
+        placePiece(king, kingTo, observer);
+        placePiece(rook, rookTo, observer);
     } else if (move.typeOf() == Move::PROMOTION) {
-        removePiece(utils::makePiece(side_to_move_, PieceType::PAWN), move.from());
-        placePiece(utils::makePiece(side_to_move_, move.promotionType()), move.to());
+        removePiece(utils::makePiece(side_to_move_, PieceType::PAWN), move.from(), observer);
+        placePiece(utils::makePiece(side_to_move_, move.promotionType()), move.to(), observer);
     } else {
         assert(at(move.from()) != Piece::NONE);
         assert(at(move.to()) == Piece::NONE);
         const auto piece = at(move.from());
 
-        removePiece(piece, move.from());
-        placePiece(piece, move.to());
+        removePiece(piece, move.from(), observer);
+        placePiece(piece, move.to(), observer);
     }
 
     if (move.typeOf() == Move::ENPASSANT) {
         assert(at<PieceType>(move.to() ^ 8) == PieceType::PAWN);
-        removePiece(utils::makePiece(~side_to_move_, PieceType::PAWN), Square(int(move.to()) ^ 8));
+        removePiece(utils::makePiece(~side_to_move_, PieceType::PAWN), Square(int(move.to()) ^ 8), observer);
     }
 
     hash_key_ ^= zobrist::sideToMove();
@@ -1665,13 +1779,15 @@ inline void Board::makeMove(const Move &move) {
     side_to_move_ = ~side_to_move_;
 }
 
-inline void Board::unmakeMove(const Move &move) {
+template <typename Observer>
+inline void Board::unmakeMove(const Move &move, Observer &observer) {
     const auto prev = prev_states_.back();
     prev_states_.pop_back();
 
     enpassant_sq_ = prev.enpassant;
     castling_rights_ = prev.castling;
     half_moves_ = prev.half_moves;
+    plies_from_null_ = prev.plies_from_null;
 
     full_moves_--;
 
@@ -1691,13 +1807,13 @@ inline void Board::unmakeMove(const Move &move) {
         const auto rook = at(rook_from_sq);
         const auto king = at(king_to_sq);
 
-        removePiece(rook, rook_from_sq);
-        removePiece(king, king_to_sq);
+        removePiece(rook, rook_from_sq, observer);
+        removePiece(king, king_to_sq, observer);
         assert(king == utils::makePiece(side_to_move_, PieceType::KING));
         assert(rook == utils::makePiece(side_to_move_, PieceType::ROOK));
 
-        placePiece(king, move.from());
-        placePiece(rook, move.to());
+        placePiece(king, move.from(), observer);
+        placePiece(rook, move.to(), observer);
 
         hash_key_ = prev.hash;
 
@@ -1710,12 +1826,12 @@ inline void Board::unmakeMove(const Move &move) {
         assert(utils::typeOfPiece(piece) != PieceType::KING);
         assert(utils::typeOfPiece(piece) != PieceType::NONE);
 
-        removePiece(piece, move.to());
-        placePiece(pawn, move.from());
+        removePiece(piece, move.to(), observer);
+        placePiece(pawn, move.from(), observer);
 
         if (prev.captured_piece != Piece::NONE) {
             assert(at(move.to()) == Piece::NONE);
-            placePiece(prev.captured_piece, move.to());
+            placePiece(prev.captured_piece, move.to(), observer);
         }
 
         hash_key_ = prev.hash;
@@ -1726,8 +1842,8 @@ inline void Board::unmakeMove(const Move &move) {
         const auto piece = at(move.to());
         assert(at(move.from()) == Piece::NONE);
 
-        removePiece(piece, move.to());
-        placePiece(piece, move.from());
+        removePiece(piece, move.to(), observer);
+        placePiece(piece, move.from(), observer);
     }
 
     if (move.typeOf() == Move::ENPASSANT) {
@@ -1735,18 +1851,20 @@ inline void Board::unmakeMove(const Move &move) {
         const auto pawnTo = static_cast<Square>(enpassant_sq_ ^ 8);
 
         assert(at(pawnTo) == Piece::NONE);
-        placePiece(pawn, pawnTo);
+        placePiece(pawn, pawnTo, observer);
     } else if (prev.captured_piece != Piece::NONE) {
         assert(at(move.to()) == Piece::NONE);
-        placePiece(prev.captured_piece, move.to());
+        placePiece(prev.captured_piece, move.to(), observer);
     }
 
     hash_key_ = prev.hash;
 }
 
 inline void Board::makeNullMove() {
-    prev_states_.emplace_back(
-        State{hash_key_, castling_rights_, enpassant_sq_, half_moves_, Piece::NONE});
+    prev_states_.push_back(
+        State{hash_key_, castling_rights_, enpassant_sq_, half_moves_, Piece::NONE, plies_from_null_});
+
+    plies_from_null_ = 0;
 
     hash_key_ ^= zobrist::sideToMove();
     if (enpassant_sq_ != NO_SQ) hash_key_ ^= zobrist::enpassant(utils::squareFile(enpassant_sq_));
@@ -1763,6 +1881,7 @@ inline void Board::unmakeNullMove() {
     enpassant_sq_ = prev.enpassant;
     castling_rights_ = prev.castling;
     half_moves_ = prev.half_moves;
+    plies_from_null_ = prev.plies_from_null;
     hash_key_ = prev.hash;
 
     full_moves_--;
@@ -2112,6 +2231,61 @@ static auto init_squares_between = []() constexpr {
 
 static const std::array<std::array<U64, 64>, 64> SQUARES_BETWEEN_BB = init_squares_between();
 
+// Cuckoo tables holding the hash difference of every reversible (non-pawn) move on an
+// empty board, used to detect repetitions that are one move away
+struct CuckooTables {
+    std::array<U64, 8192> keys{};
+    std::array<Move, 8192> moves{};
+};
+
+[[nodiscard]] inline int cuckooH1(U64 key) { return key & 0x1fff; }
+[[nodiscard]] inline int cuckooH2(U64 key) { return (key >> 16) & 0x1fff; }
+
+static auto init_cuckoo = []() {
+    CuckooTables cuckoo;
+    [[maybe_unused]] int count = 0;
+
+    for (int c = 0; c < 2; ++c) {
+        for (auto pt : {PieceType::KNIGHT, PieceType::BISHOP, PieceType::ROOK, PieceType::QUEEN,
+                        PieceType::KING}) {
+            const Piece piece = utils::makePiece(Color(c), pt);
+
+            for (int sq1 = 0; sq1 < MAX_SQ; ++sq1) {
+                Bitboard reachable = 0ull;
+                switch (pt) {
+                    case PieceType::KNIGHT: reachable = attacks::knight(Square(sq1)); break;
+                    case PieceType::BISHOP: reachable = attacks::bishop(Square(sq1), 0ull); break;
+                    case PieceType::ROOK: reachable = attacks::rook(Square(sq1), 0ull); break;
+                    case PieceType::QUEEN: reachable = attacks::queen(Square(sq1), 0ull); break;
+                    default: reachable = attacks::king(Square(sq1)); break;
+                }
+
+                for (int sq2 = sq1 + 1; sq2 < MAX_SQ; ++sq2) {
+                    if (!(reachable & (1ULL << sq2))) continue;
+
+                    Move move = Move::make<Move::NORMAL>(Square(sq1), Square(sq2));
+                    U64 key = zobrist::piece(piece, Square(sq1)) ^
+                              zobrist::piece(piece, Square(sq2)) ^ zobrist::sideToMove();
+
+                    int i = cuckooH1(key);
+                    for (;;) {
+                        std::swap(cuckoo.keys[i], key);
+                        std::swap(cuckoo.moves[i], move);
+                        if (move == Move(Move::NO_MOVE)) break;
+                        i = i == cuckooH1(key) ? cuckooH2(key) : cuckooH1(key);
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    assert(count == 3668);
+    return cuckoo;
+};
+
+static const CuckooTables CUCKOO = init_cuckoo();
+
 template <Color c>
 [[nodiscard]] Bitboard pawnLeftAttacks(const Bitboard pawns) {
     return c == Color::WHITE ? (pawns << 7) & ~MASK_FILE[static_cast<int>(File::FILE_H)]
@@ -2618,6 +2792,41 @@ inline void legalmoves(Movelist &movelist, const Board &board) {
 
 }  // namespace movegen
 
+[[nodiscard]] inline bool Board::hasGameCycle(int ply) const {
+    const int end = std::min<int>({half_moves_, plies_from_null_, prev_states_.size()});
+    if (end < 3) return false;
+
+    const int size = prev_states_.size();
+    const Bitboard occupied = occ();
+
+    for (int i = 3; i <= end; i += 2) {
+        const U64 move_key = hash_key_ ^ prev_states_[size - i].hash;
+
+        int j = movegen::cuckooH1(move_key);
+        if (movegen::CUCKOO.keys[j] != move_key) {
+            j = movegen::cuckooH2(move_key);
+            if (movegen::CUCKOO.keys[j] != move_key) continue;
+        }
+
+        const Move move = movegen::CUCKOO.moves[j];
+        if (movegen::SQUARES_BETWEEN_BB[move.from()][move.to()] & occupied) continue;
+
+        if (ply > i) return true;
+
+        // Before the root, the move has to be made by the side to move rather than lead
+        // into the current position
+        const Piece piece = at(move.from()) != Piece::NONE ? at(move.from()) : at(move.to());
+        if (color(piece) != side_to_move_) continue;
+
+        // and the earlier position has to have occurred before already
+        for (int k = i + 4; k <= end; k += 2) {
+            if (prev_states_[size - k].hash == prev_states_[size - i].hash) return true;
+        }
+    }
+
+    return false;
+}
+
 /****************************************************************************\
  * uci utility functions                                                     *
 \****************************************************************************/
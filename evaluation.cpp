@@ -1,4 +1,5 @@
 #include "evaluation.hpp"
+#include "uci.hpp"
 #include "util.hpp"
 #include <cassert>
 #include <cmath>
@@ -22,7 +23,7 @@ int evaluate_basic(const chess::Board& board) {
 }
 
 int evaluate_nnue(const nnue::Board& board) {
-    return prophet_utter_evaluation(board.get_prophet(), (uint8_t) board.sideToMove());
+    return board.evaluate();
 }
 
 int evaluate(const chess::Board& board, bool debug) {
@@ -268,7 +269,7 @@ int see(const chess::Board& board, const chess::Move& move, bool debug) {
 
     if (board.at(move.to()) != chess::Piece::NONE) {
         ret += get_value(board.at<chess::PieceType>(attacked_sq));
-        if (debug) std::cout << "S1 starts by gaining " << get_value(board.at<chess::PieceType>(attacked_sq)) << std::endl;
+        if (debug) uci::send_message("S1 starts by gaining " + std::to_string(get_value(board.at<chess::PieceType>(attacked_sq))));
     }
 
     for (chess::Color side_to_move = ~board.sideToMove();; side_to_move = ~side_to_move) {
@@ -282,8 +283,8 @@ int see(const chess::Board& board, const chess::Move& move, bool debug) {
 
                 ret += side_to_move == board.sideToMove() ? get_value(attacked_pt) : -get_value(attacked_pt);
                 if (debug) {
-                    std::cout << (side_to_move == board.sideToMove() ? "S1" : "S2") << " gains " << get_value(attacked_pt) << std::endl;
-                    std::cout << "Net gains for S1: " << ret << std::endl;
+                    uci::send_message((side_to_move == board.sideToMove() ? "S1" : "S2") + std::string(" gains ") + std::to_string(get_value(attacked_pt)));
+                    uci::send_message("Net gains for S1: " + std::to_string(ret));
                 }
 
                 const chess::Square attacker_sq = chess::builtin::lsb(attacker);
@@ -316,6 +317,87 @@ int see(const chess::Board& board, const chess::Move& move, bool debug) {
     return ret;
 }
 
+bool see_ge(const chess::Board& board, const chess::Move& move, int threshold) {
+    // Castling can't win or lose material
+    if (move.typeOf() == chess::Move::CASTLING) {
+        return threshold <= 0;
+    }
+
+    const chess::Square from = move.from();
+    const chess::Square to = move.to();
+    chess::Bitboard occ = board.occ() & ~(1ULL << from);
+
+    // What the move wins if it goes unanswered, measured against the threshold
+    int balance = -threshold;
+    if (move.typeOf() == chess::Move::ENPASSANT) {
+        balance += get_value(chess::PieceType::PAWN);
+        occ &= ~(1ULL << (to ^ 8)); // The captured pawn is on the moving pawn's rank
+    } else if (board.at(to) != chess::Piece::NONE) {
+        balance += get_value(board.at<chess::PieceType>(to));
+    }
+
+    chess::PieceType next_victim = board.at<chess::PieceType>(from);
+    if (move.typeOf() == chess::Move::PROMOTION) {
+        next_victim = move.promotionType();
+        balance += get_value(next_victim) - get_value(chess::PieceType::PAWN);
+    }
+    if (balance < 0) {
+        return false;
+    }
+
+    // Even losing the moved piece for nothing doesn't drop below the threshold
+    balance -= get_value(next_victim);
+    if (balance >= 0) {
+        return true;
+    }
+
+    chess::Bitboard diagonal_sliders = board.pieces(chess::PieceType::BISHOP) | board.pieces(chess::PieceType::QUEEN);
+    chess::Bitboard orthogonal_sliders = board.pieces(chess::PieceType::ROOK) | board.pieces(chess::PieceType::QUEEN);
+    chess::Bitboard attackers = attackers_for_side(board, to, chess::Color::WHITE, occ) |
+                                attackers_for_side(board, to, chess::Color::BLACK, occ);
+
+    // Each side recaptures with its least valuable attacker until the side to move is
+    // over its threshold even if it loses the piece it just captured with
+    chess::Color side_to_move = ~board.sideToMove();
+    for (;;) {
+        attackers &= occ;
+        chess::Bitboard side_attackers = attackers & board.us(side_to_move);
+        if (!side_attackers) {
+            break;
+        }
+
+        chess::PieceType attacker_pt = chess::PieceType::PAWN;
+        while (!(side_attackers & board.pieces(attacker_pt))) {
+            ++attacker_pt;
+        }
+        occ &= ~(1ULL << chess::builtin::lsb(side_attackers & board.pieces(attacker_pt)));
+
+        // Sliders lined up behind the capturing piece join in
+        if (attacker_pt == chess::PieceType::PAWN ||
+            attacker_pt == chess::PieceType::BISHOP ||
+            attacker_pt == chess::PieceType::QUEEN) {
+            attackers |= chess::movegen::attacks::bishop(to, occ) & diagonal_sliders;
+        }
+        if (attacker_pt == chess::PieceType::ROOK ||
+            attacker_pt == chess::PieceType::QUEEN) {
+            attackers |= chess::movegen::attacks::rook(to, occ) & orthogonal_sliders;
+        }
+
+        side_to_move = ~side_to_move;
+        balance = -balance - 1 - get_value(attacker_pt);
+        if (balance >= 0) {
+            // A king can't recapture onto a square that's still defended
+            if (attacker_pt == chess::PieceType::KING && (attackers & occ & board.us(side_to_move))) {
+                side_to_move = ~side_to_move;
+            }
+            break;
+        }
+    }
+
+    // Whoever is left to move has lost the exchange
+    return side_to_move != board.sideToMove();
+}
+
 int mvv_lva(const chess::Board& board, const chess::Move& move) {
     static constexpr int scores[] = {
         105,
@@ -24,4 +24,8 @@ int evaluate(const chess::Board& board, bool debug = false);
 
 int see(const chess::Board& board, const chess::Move& move, bool debug = false);
 
+// Whether the exchange a move starts on its destination square wins at least threshold
+// centipawns. Stops as soon as the answer is known rather than resolving the whole exchange
+bool see_ge(const chess::Board& board, const chess::Move& move, int threshold);
+
 int mvv_lva(const chess::Board& board, const chess::Move& move);
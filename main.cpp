@@ -4,250 +4,220 @@
 #include "search.hpp"
 #include "uci.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <boost/atomic.hpp>
+#include <boost/fiber/buffered_channel.hpp>
 #include <boost/fiber/unbuffered_channel.hpp>
 #include <boost/range/adaptor/indexed.hpp>
 #include <boost/thread.hpp>
 #include <chrono>
 #include <cmath>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
-#include <prophet.h>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
-class ScoredMove {
-public:
-    chess::Move move;
-    int score;
-    int static_evaluation;
+// Lazy SMP helper: runs its own iterative deepening loop against the shared TT
+// so that the main thread finds more of the tree already searched
+void helper(nnue::Board board, SearchAgent& agent, int thread_id, int max_ply, boost::atomic<bool>& stop_helpers, boost::atomic<unsigned long long>& helper_nodes) {
+    // Helpers have no deadline of their own, the main thread raises stop_helpers when it's done
+    StopCondition stop(stop_helpers, helper_nodes);
 
-    ScoredMove(const chess::Move& move, int score, int static_evaluation):
-        move(move),
-        score(score),
-        static_evaluation(static_evaluation) {}
+    std::vector<RootMove> root_moves = agent.get_root_moves(board);
 
-    inline operator chess::Move() const {
-        return this->move;
-    }
-
-    inline bool operator==(const ScoredMove& scored_move) const {
-        return this->move == scored_move.move;
-    }
+    int last_score = 0;
+    // Odd helpers start one ply deeper so that the threads spread out over different depths
+    for (int depth = 1 + thread_id % 2; !stop.is_stopping(depth) && board.fullMoveNumber() + depth <= max_ply && depth <= 256; ++depth) {
+        sort_root_moves(root_moves);
 
-    inline bool operator!=(const ScoredMove& scored_move) const {
-        return this->move != scored_move.move;
-    }
-
-    inline bool operator>(const ScoredMove& scored_move) const {
-        return this->score > scored_move.score || (this->score == scored_move.score && this->static_evaluation > scored_move.static_evaluation);
-    }
+        // Perturb the root move order so that each helper starts in a different subtree
+        if (root_moves.size() > 2) {
+            std::rotate(root_moves.begin() + 1, root_moves.begin() + 1 + thread_id % (root_moves.size() - 1), root_moves.end());
+        }
 
-    inline bool operator<(const ScoredMove& scored_move) const {
-        return this->score < scored_move.score || (this->score == scored_move.score && this->static_evaluation < scored_move.static_evaluation);
-    }
+        SearchInfo info(depth, board.fullMoveNumber());
+        agent.search_root(board, root_moves, info, last_score, depth == 1 + thread_id % 2, 1, stop);
+        stop.end_iteration(info.nodes);
 
-    inline bool operator>=(const ScoredMove& scored_move) const {
-        return this->score >= scored_move.score;
+        if (!stop.is_stopping(depth)) {
+            last_score = root_moves[0].score;
+        }
     }
+}
 
-    inline bool operator<=(const ScoredMove& scored_move) const {
-        return this->score <= scored_move.score;
-    }
+// Fixed positions searched by the bench command, covering openings, middlegames and endgames
+const std::vector<std::string> BENCH_FENS = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "rnbqkb1r/ppp1pppp/5n2/3p4/3P4/2N5/PPP1PPPP/R1BQKBNR w KQkq - 2 3",
+    "r1bqk2r/pp1nbppp/2p1pn2/3p4/2PP4/2N1PN2/PPQ2PPP/R1B1KB1R w KQkq - 2 7",
+    "r2qkb1r/pp2nppp/3p4/2pNN1B1/2BnP3/3P4/PPP2PPP/R2bK2R w KQkq - 1 1",
+    "rnbq1rk1/pp2ppbp/6p1/2pp4/2PPn3/2N1PN2/PP2BPPP/R2QKB1R w KQ - 0 8",
+    "8/8/4k3/8/2K5/3R4/8/3r4 w - - 0 1",
 };
 
-void worker(boost::fibers::unbuffered_channel<SearchRequest>& channel, boost::atomic<bool>& stop) {
-    Prophet* prophet = raise_prophet(nullptr);
+void worker(boost::fibers::buffered_channel<SearchRequest>& channel, boost::atomic<bool>& stop, boost::atomic<bool>& pondering, const boost::atomic<unsigned long long>& stopped_through, const boost::atomic<unsigned long long>& ponderhit_through) {
     SearchRequest search_req;
-    TT tt(64'000'000 / sizeof(TTEntry));
+    TT tt(64'000'000 / sizeof(TTCluster));
+    std::vector<std::unique_ptr<SearchAgent>> agents;
     while (channel.pop(search_req) == boost::fibers::channel_op_status::success) {
         if (search_req.quit) {
-            prophet_die_for_sins(prophet);
             return;
         }
 
-        stop.store(false, boost::memory_order_relaxed);
-        tt.resize(search_req.hash_size * 1'000'000 / sizeof(TTEntry));
-        search_req.board.accept_prophet(prophet);
-        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
-        const auto is_stopping = [start_time, &search_req, &stop](int starting_depth) {
-            return starting_depth > 1 && (std::chrono::steady_clock::now() - start_time > search_req.time || stop.load(boost::memory_order_relaxed));
-        };
+        // The flags are cleared before the counters are read, so a stop or ponderhit that was
+        // handled after this search was queued (but before it started) still applies to it
+        stop.store(false);
+        pondering.store(search_req.ponder);
+        if (stopped_through.load() >= search_req.id) {
+            stop.store(true);
+        }
+        if (ponderhit_through.load() >= search_req.id) {
+            pondering.store(false);
+        }
+
+        tt.resize(search_req.hash_size * 1'000'000 / sizeof(TTCluster));
 
+        // Entries from earlier searches (and earlier games) are aged rather than cleared,
+        // so they are replaced first but can still be hit while they remain
+        tt.new_search();
         if (search_req.new_game) {
+            tt.new_search();
+        }
+        if (search_req.clear_hash) {
             tt.clear();
         }
 
+        // bestmove can't be sent while pondering, even if the search has already finished
+        const auto wait_for_ponderhit = [&stop, &pondering]() {
+            while (pondering.load(boost::memory_order_relaxed) && !stop.load(boost::memory_order_relaxed)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            pondering.store(false, boost::memory_order_relaxed);
+        };
+
+        // Called once bestmove has been sent
+        const auto finish = [&search_req](const chess::Move& best_move, unsigned long long nodes) {
+            if (search_req.results) {
+                search_req.results->push(SearchResult {best_move, nodes});
+            }
+        };
+
         chess::Movelist moves;
         chess::movegen::legalmoves(moves, search_req.board);
         if (moves.empty()) {
             logger.error("Invalid position given: " + search_req.board.getFen());
-            search_req.board.release_prophet();
+            wait_for_ponderhit();
+            finish(chess::Move(0), 0);
             continue;
         } else if (moves.size() == 1) {
+            wait_for_ponderhit();
             uci::bestmove(moves[0]);
-            search_req.board.release_prophet();
+            finish(moves[0], 0);
             continue;
         }
 
-        chess::Move best_move(0);
-        int last_score;
-        unsigned long long nodes = 0;
-        int seldepth = 0;
-        int max_ply = search_req.target_depth == -1 ? 1024 : (search_req.board.fullMoveNumber() + search_req.target_depth);
-        for (int depth = 1; !is_stopping(depth) && search_req.board.fullMoveNumber() + depth <= max_ply && depth <= 256; ++depth) {
-            for (auto& move : moves) {
-                int16_t score = 0;
-                bool capture;
-
-                if (move == best_move) {
-                    score = 25000;
-                    goto set_score;
-                }
-
-                capture = move.typeOf() == chess::Move::ENPASSANT ||
-                          search_req.board.at(move.to()) != chess::Piece::NONE;
+        while (agents.size() < search_req.threads) {
+            agents.push_back(std::make_unique<SearchAgent>(&tt));
+        }
+        for (auto& agent : agents) {
+            agent->new_search(search_req.new_game);
+        }
 
-                if (capture) {
-                    if (move.typeOf() == chess::Move::ENPASSANT) {
-                        score = 10;
-                        goto set_score;
-                    }
+        int max_ply = search_req.target_depth == -1 ? 1024 : (search_req.board.fullMoveNumber() + search_req.target_depth);
 
-                    score += mvv_lva(search_req.board, move);
+        boost::atomic<bool> stop_helpers(false);
+        boost::atomic<unsigned long long> helper_nodes(0);
+        boost::thread_group helpers;
+        for (int thread_id = 1; thread_id < search_req.threads; ++thread_id) {
+            helpers.create_thread(std::bind(helper, search_req.board, std::ref(*agents[thread_id]), thread_id, max_ply, std::ref(stop_helpers), std::ref(helper_nodes)));
+        }
 
-                    if (move.typeOf() == chess::Move::PROMOTION || see(search_req.board, move) >= -100) {
-                        score += 10;
-                    } else {
-                        score -= 30001;
-                    }
-                }
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+        StopCondition stop_condition = search_req.ponder ? StopCondition(stop, search_req.time_manager.get_hard_limit(), pondering) : StopCondition(stop, start_time + search_req.time_manager.get_hard_limit());
 
-                if (move.typeOf() == chess::Move::PROMOTION) {
-                    switch (move.promotionType()) {
-                    case chess::PieceType::KNIGHT:
-                        score += 5000;
-                        break;
-                    case chess::PieceType::BISHOP:
-                        score += 6000;
-                        break;
-                    case chess::PieceType::ROOK:
-                        score += 7000;
-                        break;
-                    case chess::PieceType::QUEEN:
-                        score += 8000;
-                        break;
-                    default:
-                        throw std::logic_error("Invalid promotion");
-                    }
-                }
+        std::vector<RootMove> root_moves = agents[0]->get_root_moves(search_req.board);
 
-            set_score:
-                move.setScore(score);
-            }
-            moves.sort();
+        chess::Move best_move(0);
+        int last_score = 0;
+        unsigned long long nodes = 0;
+        int seldepth = 0;
+        for (int depth = 1; !stop_condition.is_stopping(depth) && search_req.board.fullMoveNumber() + depth <= max_ply && depth <= 256; ++depth) {
+            sort_root_moves(root_moves);
 
-            SearchAgent agent(&tt);
             SearchInfo info(depth, search_req.board.fullMoveNumber());
-            std::vector<ScoredMove> scored_moves;
-
-            if (depth == 1 || search_req.multipv > 1) {
-                int alpha = -get_value(chess::PieceType::KING);
-                int beta = get_value(chess::PieceType::KING);
-
-                for (const auto& move : moves) {
-                    search_req.board.makeMove(move);
-                    ++info.nodes;
-                    int score = -agent.search(search_req.board, -beta, -alpha, info, is_stopping);
-                    int static_evaluation = -evaluate_nnue(search_req.board);
-                    search_req.board.unmakeMove(move);
-
-                    if (is_stopping(depth)) {
-                        break;
-                    }
-
-                    if (search_req.multipv > 1) {
-                        scored_moves.emplace_back(move, score, static_evaluation);
-                    } else {
-                        if (score >= beta) {
-                            alpha = beta;
-                            scored_moves = {ScoredMove(move, alpha, static_evaluation)};
-                            break;
-                        }
-
-                        if (score > alpha) {
-                            alpha = score;
-                            scored_moves = {ScoredMove(move, alpha, static_evaluation)};
-                        }
-                    }
-                }
-            } else {
-                int lower_window_size = std::round((-150.f / (1.f + std::exp(-((depth - 1) / 3.f)))) + 175.f);
-                int upper_window_size = std::round((-150.f / (1.f + std::exp(-((depth - 1) / 3.f)))) + 175.f);
-                for (;;) {
-                    int alpha = last_score - lower_window_size;
-                    int beta = last_score + upper_window_size;
-
-                    int original_alpha = last_score - lower_window_size;
-                    for (const auto& move : moves) {
-                        search_req.board.makeMove(move);
-                        ++info.nodes;
-                        int score = -agent.search(search_req.board, -beta, -alpha, info, is_stopping);
-                        int static_evaluation = -evaluate_nnue(search_req.board);
-                        search_req.board.unmakeMove(move);
-
-                        if (is_stopping(depth)) {
-                            break;
-                        }
-
-                        if (score >= beta) {
-                            alpha = beta;
-                            scored_moves = {ScoredMove(move, alpha, static_evaluation)};
-                            continue;
-                        }
-
-                        if (score > alpha) {
-                            alpha = score;
-                            scored_moves = {ScoredMove(move, alpha, static_evaluation)};
-                        }
-                    }
-
-                    if (is_stopping(depth)) {
-                        break;
-                    }
-
-                    if (alpha <= original_alpha) {
-                        lower_window_size <<= 1;
-                    } else if (alpha >= beta) {
-                        upper_window_size <<= 1;
-                    } else {
-                        break;
-                    }
-                }
-            }
-
-            if (!is_stopping(depth)) {
-                std::sort(scored_moves.begin(), scored_moves.end(), std::greater<ScoredMove>());
-                best_move = scored_moves[0].move;
-                last_score = scored_moves[0].score;
-                nodes += info.nodes;
+            agents[0]->search_root(search_req.board, root_moves, info, last_score, depth == 1, search_req.multipv, stop_condition);
+            nodes += info.nodes;
+
+            // The best move of an interrupted iteration is still used if it beat the previous one,
+            // which is always searched first
+            best_move = root_moves[0].move;
+            if (!stop_condition.is_stopping(depth)) {
+                last_score = root_moves[0].score;
                 if (seldepth < info.seldepth) {
                     seldepth = info.seldepth;
                 }
 
+                unsigned long long total_nodes = nodes + helper_nodes.load(boost::memory_order_relaxed);
                 std::chrono::milliseconds time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
-                unsigned long long nps = (nodes / std::max<long long>(time_elapsed.count(), 1ll)) * 1000;
+                unsigned long long nps = (total_nodes / std::max<long long>(time_elapsed.count(), 1ll)) * 1000;
 
-                for (auto scored_move : scored_moves | boost::adaptors::indexed(1)) {
-                    if (scored_move.index() > search_req.multipv) {
+                for (auto root_move : root_moves | boost::adaptors::indexed(1)) {
+                    if (root_move.index() > search_req.multipv) {
                         break;
                     }
 
-                    search_req.board.makeMove(scored_move.value());
+                    search_req.board.makeMove(root_move.value().move);
                     std::vector<chess::Move> pv = get_pv(search_req.board, tt);
-                    search_req.board.unmakeMove(scored_move.value());
-                    pv.insert(pv.begin(), scored_move.value());
+                    search_req.board.unmakeMove(root_move.value().move);
+                    pv.insert(pv.begin(), root_move.value().move);
                     pv.resize(std::min<int>(pv.size(), seldepth));
 
                     std::vector<std::string> pv_strings;
@@ -256,12 +226,12 @@ void worker(boost::fibers::unbuffered_channel<SearchRequest>& channel, boost::at
                     });
 
                     std::vector<std::string> args;
-                    if (scored_move.value().score >= get_value(chess::PieceType::KING) - 1024) {
-                        args = {"multipv", std::to_string(scored_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "mate", std::to_string((get_value(chess::PieceType::KING) - scored_move.value().score + 1) / 2), "nodes", std::to_string(nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
-                    } else if (scored_move.value().score <= -get_value(chess::PieceType::KING) + 1024) {
-                        args = {"multipv", std::to_string(scored_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "mate", std::to_string(-(scored_move.value().score + get_value(chess::PieceType::KING)) / 2), "nodes", std::to_string(nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
+                    if (root_move.value().score >= get_value(chess::PieceType::KING) - 1024) {
+                        args = {"multipv", std::to_string(root_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "mate", std::to_string((get_value(chess::PieceType::KING) - root_move.value().score + 1) / 2), "nodes", std::to_string(total_nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
+                    } else if (root_move.value().score <= -get_value(chess::PieceType::KING) + 1024) {
+                        args = {"multipv", std::to_string(root_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "mate", std::to_string(-(root_move.value().score + get_value(chess::PieceType::KING)) / 2), "nodes", std::to_string(total_nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
                     } else {
-                        args = {"multipv", std::to_string(scored_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "cp", std::to_string(scored_move.value().score), "nodes", std::to_string(nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
+                        args = {"multipv", std::to_string(root_move.index()), "depth", std::to_string(depth), "seldepth", std::to_string(seldepth), "score", "cp", std::to_string(root_move.value().score), "nodes", std::to_string(total_nodes), "time", std::to_string(time_elapsed.count()), "nps", std::to_string(nps)};
                     }
 
                     if (!pv_strings.empty()) {
@@ -271,11 +241,63 @@ void worker(boost::fibers::unbuffered_channel<SearchRequest>& channel, boost::at
 
                     uci::send_message("info", args);
                 }
+
+                // While pondering the clock isn't ours, so the soft limit only counts the time since ponderhit
+                stop_condition.check_deadline();
+                std::chrono::milliseconds clock_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - stop_condition.get_start_time());
+                if (search_req.time_manager.should_stop(clock_elapsed, best_move, last_score) && !pondering.load(boost::memory_order_relaxed)) {
+                    break;
+                }
             }
+
+            stop_condition.check_deadline();
         }
 
-        uci::bestmove(best_move);
-        search_req.board.release_prophet();
+        stop_helpers.store(true, boost::memory_order_relaxed);
+        helpers.join_all();
+        wait_for_ponderhit();
+
+        // The second move of the principal variation is the reply we expect, and so the one to ponder on
+        search_req.board.makeMove(best_move);
+        std::vector<chess::Move> pv = get_pv(search_req.board, tt);
+        search_req.board.unmakeMove(best_move);
+        if (pv.empty()) {
+            uci::bestmove(best_move);
+        } else {
+            uci::bestmove(best_move, pv[0]);
+        }
+        finish(best_move, nodes + helper_nodes.load(boost::memory_order_relaxed));
+    }
+}
+
+// Reads commands on a thread of its own, so stop and ponderhit take effect even while
+// the main loop is busy starting a search or running a debug command
+void reader(boost::fibers::buffered_channel<uci::PollResult>& commands, boost::atomic<bool>& stop, boost::atomic<bool>& pondering) {
+    for (;;) {
+        uci::PollResult message = uci::poll();
+
+        str_switch(message.command) {
+            // These are queued as well, in case the search they're meant for hasn't started yet
+            str_case("stop"):
+            {
+                stop.store(true, boost::memory_order_relaxed);
+                break;
+            }
+            str_case("ponderhit"):
+            {
+                pondering.store(false, boost::memory_order_relaxed);
+                break;
+            }
+
+            str_case("quit"):
+            {
+                stop.store(true, boost::memory_order_relaxed);
+                commands.push(std::move(message));
+                return;
+            }
+        }
+
+        commands.push(std::move(message));
     }
 }
 
@@ -288,20 +310,39 @@ int main() {
                  "/ /_/ /_/ /   / /__ / /_/ /     _/ /|  / _/ /|  / / /_/ / _/ /___\n"
                  "\\____/ /_/    \\___/ \\__,_/      /_/ |_/  /_/ |_/  \\____/  /_____/\n";
 #if defined(ORCA_TIMESTAMP) && defined(ORCA_COMPILER)
-    std::cout << "Orca NNUE (mono-accumulator 1x768 feature space i16 quantized eval with 64x scaling factor) compiled @ " << ORCA_TIMESTAMP << " on compiler " << ORCA_COMPILER << std::endl;
+    std::cout << "Orca NNUE (" << (nnue::network().dual_perspective ? "dual-perspective accumulator 2x768" : "mono-accumulator 1x768") << " feature space i16 quantized eval with 64x scaling factor) compiled @ " << ORCA_TIMESTAMP << " on compiler " << ORCA_COMPILER << std::endl;
 #endif
+    logger.info("Using " + nnue::simd_level_name(nnue::simd_level()) + " NNUE kernels");
 
     nnue::Board board(chess::STARTPOS);
     uint8_t multipv = 1;
     uint16_t hash_size = 64;
+    uint8_t threads = 1;
     bool new_game = false;
 
     boost::atomic<bool> stop = false;
-    boost::fibers::unbuffered_channel<SearchRequest> channel;
-    boost::thread worker_thread(std::bind(worker, std::ref(channel), std::ref(stop)));
+    boost::atomic<bool> pondering = false;
+    // Searches are numbered in the order they're queued. A stop or ponderhit applies to
+    // every search queued before it, including ones that haven't started yet
+    unsigned long long last_search_id = 0;
+    boost::atomic<unsigned long long> stopped_through = 0;
+    boost::atomic<unsigned long long> ponderhit_through = 0;
+    boost::fibers::buffered_channel<SearchRequest> channel(16);
+    boost::thread worker_thread(std::bind(worker, std::ref(channel), std::ref(stop), std::ref(pondering), std::cref(stopped_through), std::cref(ponderhit_through)));
+
+    boost::fibers::buffered_channel<uci::PollResult> commands(1024);
+    boost::thread reader_thread(std::bind(reader, std::ref(commands), std::ref(stop), std::ref(pondering)));
+
+    // A search started while another is running waits in the channel until the worker is done,
+    // so the main loop carries on reading commands
+    const auto start_search = [&channel, &last_search_id](SearchRequest search_req) {
+        search_req.id = ++last_search_id;
+        channel.push(std::move(search_req));
+    };
 
     for (;;) {
-        auto message = uci::poll();
+        uci::PollResult message;
+        commands.pop(message);
 
         str_switch(message.command) {
             str_case("uci"):
@@ -310,12 +351,24 @@ int main() {
                 uci::send_message("id", {"author", "BlueCannonBall"});
                 uci::send_message("option", {"name", "MultiPV", "type", "spin", "default", "1", "min", "1", "max", "255"});
                 uci::send_message("option", {"name", "Hash", "type", "spin", "default", "64", "min", "1", "max", "65535"});
+                uci::send_message("option", {"name", "Threads", "type", "spin", "default", "1", "min", "1", "max", "255"});
+                uci::send_message("option", {"name", "Ponder", "type", "check", "default", "false"});
+
+                std::vector<std::string> simd_option = {"name", "SIMD", "type", "combo", "default", nnue::simd_level_name(nnue::simd_level())};
+                for (auto level : {nnue::SIMDLevel::SCALAR, nnue::SIMDLevel::SSE41, nnue::SIMDLevel::AVX2}) {
+                    if (nnue::simd_level_supported(level)) {
+                        simd_option.push_back("var");
+                        simd_option.push_back(nnue::simd_level_name(level));
+                    }
+                }
+                uci::send_message("option", simd_option);
                 uci::send_message("uciok");
                 break;
             }
 
             str_case("isready"):
             {
+                // Only answered once everything queued before it has been handled
                 uci::send_message("readyok");
                 break;
             }
@@ -333,6 +386,25 @@ int main() {
                         hash_size = std::stoi(message.args[3]);
                         break;
                     }
+                    str_case("Threads"):
+                    {
+                        threads = std::stoi(message.args[3]);
+                        break;
+                    }
+                    str_case("SIMD"):
+                    {
+                        for (auto level : {nnue::SIMDLevel::SCALAR, nnue::SIMDLevel::SSE41, nnue::SIMDLevel::AVX2}) {
+                            if (nnue::simd_level_name(level) == message.args[3]) {
+                                try {
+                                    nnue::set_simd_level(level);
+                                    logger.info("Using " + nnue::simd_level_name(level) + " NNUE kernels");
+                                } catch (const std::invalid_argument& e) {
+                                    logger.error(e.what());
+                                }
+                            }
+                        }
+                        break;
+                    }
                 }
                 break;
             }
@@ -374,14 +446,14 @@ int main() {
             {
                 using namespace std::chrono_literals;
 
-                std::chrono::milliseconds search_time = 10s;
-
                 std::chrono::milliseconds movetime = 0ms;
                 std::chrono::milliseconds wtime = 0ms;
                 std::chrono::milliseconds btime = 0ms;
                 std::chrono::milliseconds winc = 0ms;
                 std::chrono::milliseconds binc = 0ms;
+                int movestogo = 0;
                 bool infinite = false;
+                bool ponder = false;
                 int depth = -1;
                 for (auto it = message.args.begin(); it != message.args.end(); ++it) {
                     str_switch(*it) {
@@ -410,11 +482,21 @@ int main() {
                             binc = std::chrono::milliseconds(std::stoi(*++it));
                             break;
                         }
+                        str_case("movestogo"):
+                        {
+                            movestogo = std::stoi(*++it);
+                            break;
+                        }
                         str_case("infinite"):
                         {
                             infinite = true;
                             break;
                         }
+                        str_case("ponder"):
+                        {
+                            ponder = true;
+                            break;
+                        }
                         str_case("depth"):
                         {
                             depth = stoi(*++it);
@@ -423,66 +505,65 @@ int main() {
                     }
                 }
 
-                if (infinite || depth != -1) {
-                    search_time = 10h;
-                } else {
-                    if (board.sideToMove() == chess::Color::WHITE) {
-                        if (movetime != 0ms) {
-                            search_time = movetime;
-                        } else if (wtime != 0ms) {
-                            search_time = wtime / 30;
-                        }
-
-                        if (search_time < winc + 25ms) {
-                            search_time = winc + 25ms;
-                        }
-                    } else if (board.sideToMove() == chess::Color::BLACK) {
-                        if (movetime != 0ms) {
-                            search_time = movetime;
-                        } else if (btime != 0ms) {
-                            search_time = btime / 30;
-                        }
+                std::chrono::milliseconds time = board.sideToMove() == chess::Color::WHITE ? wtime : btime;
+                std::chrono::milliseconds increment = board.sideToMove() == chess::Color::WHITE ? winc : binc;
 
-                        if (search_time < binc + 25ms) {
-                            search_time = binc + 25ms;
-                        }
-                    } else {
-                        throw std::logic_error("Invalid side to move");
-                    }
+                TimeManager time_manager(10s);
+                if (infinite || depth != -1) {
+                    time_manager = TimeManager(10h);
+                } else if (movetime != 0ms) {
+                    time_manager = TimeManager(std::max(movetime - TimeManager::MOVE_OVERHEAD, 1ms));
+                } else if (time != 0ms) {
+                    time_manager = TimeManager(time, increment, movestogo);
                 }
 
-                channel.push(SearchRequest {
+                start_search(SearchRequest {
                     .board = board,
                     .multipv = multipv,
+                    .threads = threads,
                     .hash_size = hash_size,
-                    .time = search_time,
+                    .time_manager = time_manager,
                     .target_depth = depth,
-                    .new_game = new_game});
+                    .new_game = new_game,
+                    .ponder = ponder});
                 new_game = false;
 
                 break;
             }
 
+            str_case("ponderhit"):
+            {
+                // The expected move was played, so the search carries on with our own clock running
+                ponderhit_through.store(last_search_id);
+                pondering.store(false);
+                break;
+            }
+
             str_case("stop"):
             {
-                stop.store(true, boost::memory_order_relaxed);
+                stopped_through.store(last_search_id);
+                stop.store(true);
                 break;
             }
 
             str_case("quit"):
             {
-                stop.store(true, boost::memory_order_relaxed);
+                stopped_through.store(last_search_id);
+                stop.store(true);
                 channel.push(SearchRequest {
                     .quit = true,
                 });
                 worker_thread.join();
+                reader_thread.join();
                 return 0;
             }
 
             str_case("show"):
             {
-                std::cout << "Current board:" << std::endl;
-                std::cout << board << std::endl;
+                std::ostringstream ss;
+                ss << "Current board:\n"
+                   << board;
+                uci::send_message(ss.str());
                 break;
             }
 
@@ -490,14 +571,146 @@ int main() {
                 str_case("evaluate"):
             {
                 int evaluation = evaluate(board, true);
-                std::cout << "HCE Evaluation: " << evaluation << std::endl;
+                uci::send_message("HCE Evaluation: " + std::to_string(evaluation));
+                break;
+            }
+
+            str_case("evalcheck"):
+            {
+                // Checks the quantized NNUE against reference scores, given either as "fen;score" lines in a
+                // file (such as evaluations recorded from prophet) or worked out in floating point for the bench positions
+                std::vector<std::pair<std::string, double>> references;
+                if (message.args.empty()) {
+                    for (const auto& fen : BENCH_FENS) {
+                        references.push_back({fen, nnue::reference_evaluate(chess::Board(fen))});
+                    }
+                } else {
+                    std::ifstream file(message.args[0]);
+                    if (!file.is_open()) {
+                        uci::send_message("Failed to open " + message.args[0]);
+                        break;
+                    }
+                    for (std::string line; std::getline(file, line);) {
+                        size_t separator = line.find(';');
+                        if (separator != std::string::npos) {
+                            references.push_back({line.substr(0, separator), std::stod(line.substr(separator + 1))});
+                        }
+                    }
+                }
+
+                double max_difference = 0.;
+                double total_difference = 0.;
+                for (const auto& reference : references) {
+                    int evaluation = evaluate_nnue(nnue::Board(reference.first));
+                    double difference = std::abs(evaluation - reference.second);
+                    std::ostringstream ss;
+                    ss << reference.first << ": " << evaluation << " (reference " << reference.second << ')';
+                    uci::send_message(ss.str());
+                    max_difference = std::max(max_difference, difference);
+                    total_difference += difference;
+                }
+                std::ostringstream ss;
+                ss << "Positions checked: " << references.size() << '\n'
+                   << "Max difference: " << max_difference << " cp\n"
+                   << "Mean difference: " << total_difference / std::max<size_t>(references.size(), 1) << " cp";
+                uci::send_message(ss.str());
                 break;
             }
 
             str_case("see"):
             {
                 int evaluation = see(board, chess::uci::uciToMove(board, message.args[0]), true);
-                std::cout << "SEE Evaluation: " << evaluation << std::endl;
+                uci::send_message("SEE Evaluation: " + std::to_string(evaluation));
+                break;
+            }
+
+            str_case("makebench"):
+            {
+                unsigned long long cycles = message.args.empty() ? 10'000'000 : std::stoull(message.args[0]);
+                uci::send_message("Make/unmake cycles per second (chess::Board): " + std::to_string((unsigned long long) bench_make_unmake(chess::Board(board.getFen()), cycles)));
+                uci::send_message("Make/unmake cycles per second (nnue::Board): " + std::to_string((unsigned long long) bench_make_unmake(board, cycles, false)));
+                uci::send_message("Make/evaluate/unmake cycles per second (nnue::Board): " + std::to_string((unsigned long long) bench_make_unmake(board, cycles)));
+                break;
+            }
+
+            str_case("bench"):
+            {
+                int bench_depth = message.args.empty() ? 8 : std::stoi(message.args[0]);
+                uint8_t bench_threads = message.args.size() < 2 ? 1 : std::stoi(message.args[1]);
+                uint16_t bench_hash_size = message.args.size() < 3 ? 16 : std::stoi(message.args[2]);
+
+                // Every position starts from a cleared hash table, so the node count is a
+                // deterministic signature of the search when using one thread
+                boost::fibers::unbuffered_channel<SearchResult> results;
+                unsigned long long nodes = 0;
+                std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+                for (const auto& fen : BENCH_FENS) {
+                    start_search(SearchRequest {
+                        .board = nnue::Board(fen),
+                        .multipv = 1,
+                        .threads = bench_threads,
+                        .hash_size = bench_hash_size,
+                        .time_manager = TimeManager(std::chrono::hours(24)),
+                        .target_depth = bench_depth,
+                        .new_game = true,
+                        .clear_hash = true,
+                        .results = &results});
+
+                    SearchResult result {};
+                    results.pop(result);
+                    nodes += result.nodes;
+                }
+                std::chrono::milliseconds time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+
+                uci::send_message("Nodes searched: " + std::to_string(nodes));
+                uci::send_message("Time: " + std::to_string(time_elapsed.count()) + " ms (" + std::to_string(nodes * 1000 / std::max<long long>(time_elapsed.count(), 1)) + " nps)");
+                new_game = true;
+                break;
+            }
+
+            str_case("perft"):
+                str_case("divide"):
+            {
+                chess::Board perft_board(board.getFen());
+                int depth = message.args.empty() ? 5 : std::stoi(message.args[0]);
+                int perft_threads = message.args.size() < 2 ? threads : std::stoi(message.args[1]);
+                size_t perft_hash_size = message.args.size() < 3 ? 0 : std::stoull(message.args[2]);
+
+                std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+                std::vector<std::pair<chess::Move, unsigned long long>> results;
+                try {
+                    results = perft(perft_board, depth, perft_threads, perft_hash_size);
+                } catch (const std::invalid_argument& e) {
+                    uci::send_message(e.what());
+                    break;
+                }
+                std::chrono::duration<double> time_elapsed = std::chrono::steady_clock::now() - start_time;
+
+                unsigned long long nodes = 0;
+                for (const auto& result : results) {
+                    if (message.command == "divide") {
+                        uci::send_message(chess::uci::moveToUci(result.first) + ": " + std::to_string(result.second));
+                    }
+                    nodes += result.second;
+                }
+                std::ostringstream ss;
+                ss << "Time: " << (unsigned long long) (time_elapsed.count() * 1000) << " ms (" << nodes / time_elapsed.count() / 1'000'000 << " Mnps)";
+                uci::send_message("Nodes searched: " + std::to_string(nodes));
+                uci::send_message(ss.str());
+                break;
+            }
+
+            str_case("verifyhash"):
+            {
+                chess::Board verification_board(board.getFen());
+                int depth = message.args.empty() ? 5 : std::stoi(message.args[0]);
+                try {
+                    unsigned long long positions = verify_hash(verification_board, depth);
+                    uci::send_message("Hash verified in " + std::to_string(positions) + " positions");
+                } catch (const std::logic_error& e) {
+                    uci::send_message(e.what());
+                }
+                break;
             }
         }
     }
@@ -1,63 +1,691 @@
 #include "nnue.hpp"
-#include <utility>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <bzlib.h>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+
+#ifndef ORCA_EVALFILE
+    #define ORCA_EVALFILE "prophet-nnue/nnue/nnue.npz"
+#endif
+
+// Embed the network in the binary so that Orca doesn't depend on the working directory
+asm(".section .rodata\n"
+    ".global orca_evalfile_data\n"
+    ".balign 64\n"
+    "orca_evalfile_data:\n"
+    ".incbin \"" ORCA_EVALFILE "\"\n"
+    ".global orca_evalfile_end\n"
+    "orca_evalfile_end:\n"
+    ".previous\n");
+
+extern "C" const uint8_t orca_evalfile_data[];
+extern "C" const uint8_t orca_evalfile_end[];
 
 namespace nnue {
+    namespace {
+        struct NpyArray {
+            std::vector<size_t> shape;
+            std::vector<double> values;
+            bool is_float;
+
+            size_t size() const {
+                size_t ret = 1;
+                for (auto dim : shape) {
+                    ret *= dim;
+                }
+                return ret;
+            }
+        };
+
+        template <typename T>
+        T read_le(const uint8_t* data) {
+            T ret;
+            memcpy(&ret, data, sizeof(T));
+            return ret;
+        }
+
+        std::vector<uint8_t> decompress(const uint8_t* data, size_t compressed_size, size_t uncompressed_size, uint16_t method) {
+            std::vector<uint8_t> ret(uncompressed_size);
+            switch (method) {
+            case 0: // Stored
+                if (compressed_size != uncompressed_size) {
+                    throw std::runtime_error("Corrupt stored entry in network file");
+                }
+                std::copy(data, data + compressed_size, ret.begin());
+                break;
+
+            case 8: { // Deflate
+                z_stream stream {};
+                stream.next_in = const_cast<Bytef*>(data);
+                stream.avail_in = compressed_size;
+                stream.next_out = ret.data();
+                stream.avail_out = uncompressed_size;
+                if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+                    throw std::runtime_error("Failed to initialize inflate");
+                }
+                int status = inflate(&stream, Z_FINISH);
+                inflateEnd(&stream);
+                if (status != Z_STREAM_END) {
+                    throw std::runtime_error("Failed to inflate network file entry");
+                }
+                break;
+            }
+
+            case 12: { // Bzip2
+                unsigned int dest_size = uncompressed_size;
+                if (BZ2_bzBuffToBuffDecompress((char*) ret.data(), &dest_size, (char*) data, compressed_size, 0, 0) != BZ_OK || dest_size != uncompressed_size) {
+                    throw std::runtime_error("Failed to decompress bzip2 network file entry");
+                }
+                break;
+            }
+
+            default:
+                throw std::runtime_error("Unsupported compression method in network file: " + std::to_string(method));
+            }
+            return ret;
+        }
+
+        NpyArray parse_npy(const std::vector<uint8_t>& npy) {
+            if (npy.size() < 10 || memcmp(npy.data(), "\x93NUMPY", 6) != 0) {
+                throw std::runtime_error("Invalid npy array in network file");
+            }
+
+            size_t header_len;
+            size_t header_start;
+            if (npy[6] == 1) {
+                header_len = read_le<uint16_t>(&npy[8]);
+                header_start = 10;
+            } else {
+                header_len = read_le<uint32_t>(&npy[8]);
+                header_start = 12;
+            }
+            std::string header((const char*) &npy[header_start], header_len);
+
+            size_t descr_pos = header.find("'descr'");
+            size_t descr_start = header.find('\'', header.find(':', descr_pos)) + 1;
+            std::string descr = header.substr(descr_start, header.find('\'', descr_start) - descr_start);
+            bool fortran_order = header.find("'fortran_order': True") != std::string::npos;
+
+            NpyArray ret;
+            size_t shape_start = header.find('(', header.find("'shape'")) + 1;
+            std::string shape = header.substr(shape_start, header.find(')', shape_start) - shape_start);
+            for (const auto& dim : chess::utils::splitString(shape, ',')) {
+                std::string trimmed = dim;
+                chess::utils::trim(trimmed);
+                if (!trimmed.empty()) {
+                    ret.shape.push_back(std::stoull(trimmed));
+                }
+            }
+
+            if (descr.size() < 3 || descr[0] == '>') {
+                throw std::runtime_error("Unsupported npy dtype in network file: " + descr);
+            }
+            char kind = descr[1];
+            int width = std::stoi(descr.substr(2));
+
+            const uint8_t* data = &npy[header_start + header_len];
+            size_t size = ret.size();
+            if (header_start + header_len + size * width > npy.size()) {
+                throw std::runtime_error("Truncated npy array in network file");
+            }
+
+            ret.is_float = kind == 'f';
+            ret.values.resize(size);
+            for (size_t i = 0; i < size; ++i) {
+                const uint8_t* element = data + i * width;
+                if (kind == 'f' && width == 4) {
+                    ret.values[i] = read_le<float>(element);
+                } else if (kind == 'f' && width == 8) {
+                    ret.values[i] = read_le<double>(element);
+                } else if (kind == 'i' && width == 2) {
+                    ret.values[i] = read_le<int16_t>(element);
+                } else if (kind == 'i' && width == 4) {
+                    ret.values[i] = read_le<int32_t>(element);
+                } else {
+                    throw std::runtime_error("Unsupported npy dtype in network file: " + descr);
+                }
+            }
+
+            // Normalize two dimensional arrays to row-major order
+            if (fortran_order && ret.shape.size() == 2) {
+                std::vector<double> transposed(size);
+                for (size_t row = 0; row < ret.shape[0]; ++row) {
+                    for (size_t col = 0; col < ret.shape[1]; ++col) {
+                        transposed[row * ret.shape[1] + col] = ret.values[col * ret.shape[0] + row];
+                    }
+                }
+                ret.values = std::move(transposed);
+            }
+
+            return ret;
+        }
+
+        // Arrays are keyed by their member name without the .npy extension
+        std::map<std::string, NpyArray> parse_npz(const uint8_t* data, size_t size) {
+            // Find the end of central directory record
+            size_t eocd = std::string::npos;
+            for (size_t i = size >= 22 ? size - 21 : 0; i-- > 0;) {
+                if (read_le<uint32_t>(data + i) == 0x06054b50) {
+                    eocd = i;
+                    break;
+                }
+            }
+            if (eocd == std::string::npos) {
+                throw std::runtime_error("Network file is not a valid npz archive");
+            }
+
+            uint64_t entry_count = read_le<uint16_t>(data + eocd + 10);
+            uint64_t cd_offset = read_le<uint32_t>(data + eocd + 16);
+            if (cd_offset == 0xFFFFFFFF && eocd >= 20 && read_le<uint32_t>(data + eocd - 20) == 0x07064b50) {
+                uint64_t zip64_eocd = read_le<uint64_t>(data + eocd - 20 + 8);
+                entry_count = read_le<uint64_t>(data + zip64_eocd + 32);
+                cd_offset = read_le<uint64_t>(data + zip64_eocd + 48);
+            }
+
+            std::map<std::string, NpyArray> ret;
+            const uint8_t* entry = data + cd_offset;
+            for (uint64_t i = 0; i < entry_count; ++i) {
+                if (read_le<uint32_t>(entry) != 0x02014b50) {
+                    throw std::runtime_error("Corrupt central directory in network file");
+                }
+
+                uint16_t method = read_le<uint16_t>(entry + 10);
+                uint64_t compressed_size = read_le<uint32_t>(entry + 20);
+                uint64_t uncompressed_size = read_le<uint32_t>(entry + 24);
+                uint16_t name_len = read_le<uint16_t>(entry + 28);
+                uint16_t extra_len = read_le<uint16_t>(entry + 30);
+                uint16_t comment_len = read_le<uint16_t>(entry + 32);
+                uint64_t local_offset = read_le<uint32_t>(entry + 42);
+
+                // Zip64 extended information
+                for (const uint8_t* extra = entry + 46 + name_len; extra + 4 <= entry + 46 + name_len + extra_len;) {
+                    uint16_t id = read_le<uint16_t>(extra);
+                    uint16_t len = read_le<uint16_t>(extra + 2);
+                    if (id == 0x0001) {
+                        const uint8_t* field = extra + 4;
+                        if (uncompressed_size == 0xFFFFFFFF) {
+                            uncompressed_size = read_le<uint64_t>(field);
+                            field += 8;
+                        }
+                        if (compressed_size == 0xFFFFFFFF) {
+                            compressed_size = read_le<uint64_t>(field);
+                            field += 8;
+                        }
+                        if (local_offset == 0xFFFFFFFF) {
+                            local_offset = read_le<uint64_t>(field);
+                        }
+                    }
+                    extra += 4 + len;
+                }
+
+                const uint8_t* local = data + local_offset;
+                if (read_le<uint32_t>(local) != 0x04034b50) {
+                    throw std::runtime_error("Corrupt local file header in network file");
+                }
+                const uint8_t* contents = local + 30 + read_le<uint16_t>(local + 26) + read_le<uint16_t>(local + 28);
+                if (contents + compressed_size > data + size) {
+                    throw std::runtime_error("Truncated network file");
+                }
+
+                std::string name((const char*) entry + 46, name_len);
+                if (name.size() >= 4 && name.compare(name.size() - 4, 4, ".npy") == 0) {
+                    name.erase(name.size() - 4);
+                }
+                if (ret.count(name)) {
+                    throw std::runtime_error("Duplicate array in network file: " + name);
+                }
+                ret[name] = parse_npy(decompress(contents, compressed_size, uncompressed_size, method));
+                entry += 46 + name_len + extra_len + comment_len;
+            }
+
+            return ret;
+        }
+
+        // The network as stored in the file, with integer arrays scaled back to floating point
+        struct FloatNetwork {
+            std::vector<double> feature_weights; // [INPUT_SIZE][L1_SIZE]
+            std::vector<double> feature_bias;
+            std::vector<double> output_weights;
+            double output_bias;
+        };
+
+        enum Layer {
+            FEATURE_WEIGHTS,
+            FEATURE_BIAS,
+            OUTPUT_WEIGHTS,
+            OUTPUT_BIAS,
+            LAYER_COUNT,
+        };
+
+        // The names each layer may be saved under, as PyTorch module names (ft/out, fc1/fc2 or l0/l1)
+        // or as short or spelled out array names
+        const std::vector<std::string> LAYER_NAMES[LAYER_COUNT] = {
+            {"ft.weight", "fc1.weight", "l0.weight", "fw", "feature_weights"},
+            {"ft.bias", "fc1.bias", "l0.bias", "fb", "feature_bias"},
+            {"out.weight", "fc2.weight", "l1.weight", "ow", "output_weights"},
+            {"out.bias", "fc2.bias", "l1.bias", "ob", "output_bias"},
+        };
+
+        // Layers are looked up by name: the feature weights ([L1, 768] or its transpose), the feature bias ([L1]),
+        // the output weights ([1, L1] or [1, 2 * L1] for dual-perspective networks) and the output bias ([1])
+        FloatNetwork read_network(const uint8_t* data, size_t size) {
+            std::map<std::string, NpyArray> arrays = parse_npz(data, size);
+
+            const NpyArray* layers[LAYER_COUNT] = {};
+            for (const auto& array : arrays) {
+                bool found = false;
+                for (int i = 0; i < LAYER_COUNT; ++i) {
+                    if (std::find(LAYER_NAMES[i].begin(), LAYER_NAMES[i].end(), array.first) != LAYER_NAMES[i].end()) {
+                        if (layers[i]) {
+                            throw std::runtime_error("Network file has more than one " + LAYER_NAMES[i][0] + " array");
+                        }
+                        layers[i] = &array.second;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    throw std::runtime_error("Unexpected array in network file: " + array.first);
+                }
+            }
+
+            const auto get_array = [&layers](Layer layer) -> const NpyArray& {
+                if (!layers[layer]) {
+                    std::string names;
+                    for (const auto& name : LAYER_NAMES[layer]) {
+                        names += (names.empty() ? "" : ", ") + name;
+                    }
+                    throw std::runtime_error("Network file is missing " + LAYER_NAMES[layer][0] + " (saved as one of " + names + ")");
+                }
+                return *layers[layer];
+            };
+            const auto wrong_shape = [](const std::string& name) {
+                return std::runtime_error("Wrong shape for " + name + " in network file (expected " + std::to_string(INPUT_SIZE) + "x" + std::to_string(L1_SIZE) + "x1 network)");
+            };
+            const auto value = [](const NpyArray& array, size_t i, int scale) {
+                return array.is_float ? array.values[i] : array.values[i] / scale;
+            };
+
+            FloatNetwork ret;
+            const NpyArray& feature_weights = get_array(FEATURE_WEIGHTS);
+            ret.feature_weights.resize(INPUT_SIZE * L1_SIZE);
+            if (feature_weights.shape.size() == 2 && feature_weights.shape[0] == L1_SIZE && feature_weights.shape[1] == INPUT_SIZE) {
+                for (size_t neuron = 0; neuron < L1_SIZE; ++neuron) {
+                    for (size_t feature = 0; feature < INPUT_SIZE; ++feature) {
+                        ret.feature_weights[feature * L1_SIZE + neuron] = value(feature_weights, neuron * INPUT_SIZE + feature, QA);
+                    }
+                }
+            } else if (feature_weights.shape.size() == 2 && feature_weights.shape[0] == INPUT_SIZE && feature_weights.shape[1] == L1_SIZE) {
+                for (size_t i = 0; i < feature_weights.size(); ++i) {
+                    ret.feature_weights[i] = value(feature_weights, i, QA);
+                }
+            } else {
+                throw wrong_shape("ft.weight");
+            }
+
+            const NpyArray& feature_bias = get_array(FEATURE_BIAS);
+            if (feature_bias.size() != L1_SIZE) {
+                throw wrong_shape("ft.bias");
+            }
+            for (size_t i = 0; i < L1_SIZE; ++i) {
+                ret.feature_bias.push_back(value(feature_bias, i, QA));
+            }
+
+            const NpyArray& output_weights = get_array(OUTPUT_WEIGHTS);
+            if (output_weights.size() != L1_SIZE && output_weights.size() != 2 * L1_SIZE) {
+                throw wrong_shape("out.weight");
+            }
+            for (size_t i = 0; i < output_weights.size(); ++i) {
+                ret.output_weights.push_back(value(output_weights, i, QB));
+            }
+
+            const NpyArray& output_bias = get_array(OUTPUT_BIAS);
+            if (output_bias.size() != 1) {
+                throw wrong_shape("out.bias");
+            }
+            ret.output_bias = value(output_bias, 0, QA * QB);
+
+            return ret;
+        }
+
+        int16_t quantize(double value, int scale) {
+            return std::clamp<double>(std::round(value * scale), INT16_MIN, INT16_MAX);
+        }
+
+        std::unique_ptr<Network> load_network(const uint8_t* data, size_t size) {
+            FloatNetwork float_network = read_network(data, size);
+
+            std::unique_ptr<Network> ret(new Network);
+            for (size_t i = 0; i < float_network.feature_weights.size(); ++i) {
+                ret->feature_weights[i / L1_SIZE][i % L1_SIZE] = quantize(float_network.feature_weights[i], QA);
+            }
+            for (size_t i = 0; i < L1_SIZE; ++i) {
+                ret->feature_bias[i] = quantize(float_network.feature_bias[i], QA);
+            }
+            std::fill(std::begin(ret->output_weights), std::end(ret->output_weights), 0);
+            for (size_t i = 0; i < float_network.output_weights.size(); ++i) {
+                ret->output_weights[i] = quantize(float_network.output_weights[i], QB);
+            }
+            ret->output_bias = std::round(float_network.output_bias * QA * QB);
+            ret->dual_perspective = float_network.output_weights.size() == 2 * L1_SIZE;
+            return ret;
+        }
+
+        SIMDLevel detect_simd_level() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return SIMDLevel::AVX2;
+            } else if (__builtin_cpu_supports("sse4.1")) {
+                return SIMDLevel::SSE41;
+            }
+#endif
+            return SIMDLevel::SCALAR;
+        }
+
+        // Can be changed with the SIMD option while search threads are reading it
+        boost::atomic<SIMDLevel> current_simd_level(detect_simd_level());
+
+        inline void add_scalar(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; ++i) {
+                accumulator[i] += weights[i];
+            }
+        }
+
+        inline void sub_scalar(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; ++i) {
+                accumulator[i] -= weights[i];
+            }
+        }
+
+        inline int32_t output_scalar(const int16_t* accumulator, const int16_t* weights) {
+            int32_t ret = 0;
+            for (int i = 0; i < L1_SIZE; ++i) {
+                ret += std::clamp<int32_t>(accumulator[i], 0, QA) * weights[i];
+            }
+            return ret;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        __attribute__((target("avx2"))) inline void add_avx2(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; i += 16) {
+                __m256i values = _mm256_loadu_si256((const __m256i*) &accumulator[i]);
+                values = _mm256_add_epi16(values, _mm256_loadu_si256((const __m256i*) &weights[i]));
+                _mm256_storeu_si256((__m256i*) &accumulator[i], values);
+            }
+        }
+
+        __attribute__((target("avx2"))) inline void sub_avx2(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; i += 16) {
+                __m256i values = _mm256_loadu_si256((const __m256i*) &accumulator[i]);
+                values = _mm256_sub_epi16(values, _mm256_loadu_si256((const __m256i*) &weights[i]));
+                _mm256_storeu_si256((__m256i*) &accumulator[i], values);
+            }
+        }
+
+        __attribute__((target("avx2"))) inline int32_t output_avx2(const int16_t* accumulator, const int16_t* weights) {
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i qa = _mm256_set1_epi16(QA);
+            __m256i sum = _mm256_setzero_si256();
+            for (int i = 0; i < L1_SIZE; i += 16) {
+                __m256i values = _mm256_loadu_si256((const __m256i*) &accumulator[i]);
+                values = _mm256_min_epi16(_mm256_max_epi16(values, zero), qa);
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(values, _mm256_loadu_si256((const __m256i*) &weights[i])));
+            }
+            __m128i ret = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+            ret = _mm_add_epi32(ret, _mm_shuffle_epi32(ret, 0b01001110));
+            ret = _mm_add_epi32(ret, _mm_shuffle_epi32(ret, 0b10110001));
+            return _mm_cvtsi128_si32(ret);
+        }
+
+        __attribute__((target("sse4.1"))) inline void add_sse41(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; i += 8) {
+                __m128i values = _mm_loadu_si128((const __m128i*) &accumulator[i]);
+                values = _mm_add_epi16(values, _mm_loadu_si128((const __m128i*) &weights[i]));
+                _mm_storeu_si128((__m128i*) &accumulator[i], values);
+            }
+        }
+
+        __attribute__((target("sse4.1"))) inline void sub_sse41(int16_t* accumulator, const int16_t* weights) {
+            for (int i = 0; i < L1_SIZE; i += 8) {
+                __m128i values = _mm_loadu_si128((const __m128i*) &accumulator[i]);
+                values = _mm_sub_epi16(values, _mm_loadu_si128((const __m128i*) &weights[i]));
+                _mm_storeu_si128((__m128i*) &accumulator[i], values);
+            }
+        }
+
+        __attribute__((target("sse4.1"))) inline int32_t output_sse41(const int16_t* accumulator, const int16_t* weights) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i qa = _mm_set1_epi16(QA);
+            __m128i sum = _mm_setzero_si128();
+            for (int i = 0; i < L1_SIZE; i += 8) {
+                __m128i values = _mm_loadu_si128((const __m128i*) &accumulator[i]);
+                values = _mm_min_epi16(_mm_max_epi16(values, zero), qa);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(values, _mm_loadu_si128((const __m128i*) &weights[i])));
+            }
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0b01001110));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0b10110001));
+            return _mm_cvtsi128_si32(sum);
+        }
+#endif
+
+        inline int32_t output_layer(const int16_t* values, const int16_t* weights) {
+            switch (current_simd_level.load(boost::memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMDLevel::AVX2:
+                return output_avx2(values, weights);
+            case SIMDLevel::SSE41:
+                return output_sse41(values, weights);
+#endif
+            default:
+                return output_scalar(values, weights);
+            }
+        }
+    } // namespace
+
+    const Network& network() {
+        static std::unique_ptr<Network> network = load_network(orca_evalfile_data, orca_evalfile_end - orca_evalfile_data);
+        return *network;
+    }
+
+    namespace {
+        // Bound during static initialization, so the hot paths don't go through network()'s guard.
+        // Nothing uses the network before main starts
+        const Network& loaded_network = network();
+    } // namespace
+
+    SIMDLevel simd_level() {
+        return current_simd_level.load(boost::memory_order_relaxed);
+    }
+
+    bool simd_level_supported(SIMDLevel level) {
+        static SIMDLevel best_level = detect_simd_level();
+        return level <= best_level;
+    }
+
+    void set_simd_level(SIMDLevel level) {
+        if (!simd_level_supported(level)) {
+            throw std::invalid_argument("SIMD level " + simd_level_name(level) + " is not supported by this CPU");
+        }
+        current_simd_level.store(level, boost::memory_order_relaxed);
+    }
+
+    std::string simd_level_name(SIMDLevel level) {
+        switch (level) {
+        case SIMDLevel::SCALAR:
+            return "scalar";
+        case SIMDLevel::SSE41:
+            return "SSE4.1";
+        case SIMDLevel::AVX2:
+            return "AVX2";
+        default:
+            throw std::logic_error("Invalid SIMD level");
+        }
+    }
+
+    void refresh(Accumulator& accumulator, const chess::Board& board) {
+        // Mono-accumulator networks never read black's perspective
+        int perspectives = loaded_network.dual_perspective ? 2 : 1;
+        for (int i = 0; i < perspectives; ++i) {
+            std::copy(std::begin(loaded_network.feature_bias), std::end(loaded_network.feature_bias), accumulator.values[i]);
+        }
+        chess::Bitboard occ = board.occ();
+        while (occ) {
+            chess::Square sq = chess::builtin::poplsb(occ);
+            activate(accumulator, board.at(sq), sq);
+        }
+    }
+
+    void activate(Accumulator& accumulator, chess::Piece piece, chess::Square sq) {
+        // Mono-accumulator networks never read black's perspective
+        int perspectives = loaded_network.dual_perspective ? 2 : 1;
+        for (int i = 0; i < perspectives; ++i) {
+            chess::Color perspective = (chess::Color) i;
+            const int16_t* weights = loaded_network.feature_weights[feature_index(perspective, piece, sq)];
+            int16_t* values = accumulator.values[(uint8_t) perspective];
+            switch (current_simd_level.load(boost::memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMDLevel::AVX2:
+                add_avx2(values, weights);
+                break;
+            case SIMDLevel::SSE41:
+                add_sse41(values, weights);
+                break;
+#endif
+            default:
+                add_scalar(values, weights);
+                break;
+            }
+        }
+    }
+
+    void deactivate(Accumulator& accumulator, chess::Piece piece, chess::Square sq) {
+        // Mono-accumulator networks never read black's perspective
+        int perspectives = loaded_network.dual_perspective ? 2 : 1;
+        for (int i = 0; i < perspectives; ++i) {
+            chess::Color perspective = (chess::Color) i;
+            const int16_t* weights = loaded_network.feature_weights[feature_index(perspective, piece, sq)];
+            int16_t* values = accumulator.values[(uint8_t) perspective];
+            switch (current_simd_level.load(boost::memory_order_relaxed)) {
+#if defined(__x86_64__) || defined(__i386__)
+            case SIMDLevel::AVX2:
+                sub_avx2(values, weights);
+                break;
+            case SIMDLevel::SSE41:
+                sub_sse41(values, weights);
+                break;
+#endif
+            default:
+                sub_scalar(values, weights);
+                break;
+            }
+        }
+    }
+
+    int evaluate(const Accumulator& accumulator, chess::Color side_to_move) {
+        if (loaded_network.dual_perspective) {
+            int64_t output = output_layer(accumulator.values[(uint8_t) side_to_move], loaded_network.output_weights) +
+                             output_layer(accumulator.values[(uint8_t) ~side_to_move], loaded_network.output_weights + L1_SIZE) +
+                             loaded_network.output_bias;
+            return output * SCALE / (QA * QB);
+        } else {
+            // Mono-accumulator networks only look at white's perspective
+            int64_t output = output_layer(accumulator.values[(uint8_t) chess::Color::WHITE], loaded_network.output_weights) +
+                             loaded_network.output_bias;
+            int ret = output * SCALE / (QA * QB);
+            return side_to_move == chess::Color::WHITE ? ret : -ret;
+        }
+    }
+
+    double reference_evaluate(const chess::Board& board) {
+        static FloatNetwork float_network = read_network(orca_evalfile_data, orca_evalfile_end - orca_evalfile_data);
+        bool dual_perspective = float_network.output_weights.size() == 2 * L1_SIZE;
+
+        // Same hidden layer as refresh, but with a [0, 1] clipped ReLU in place of [0, QA]
+        double output = float_network.output_bias;
+        for (int i = 0; i < (dual_perspective ? 2 : 1); ++i) {
+            chess::Color perspective = dual_perspective ? (i == 0 ? board.sideToMove() : ~board.sideToMove()) : chess::Color::WHITE;
+            for (int neuron = 0; neuron < L1_SIZE; ++neuron) {
+                double value = float_network.feature_bias[neuron];
+                chess::Bitboard occ = board.occ();
+                while (occ) {
+                    chess::Square sq = chess::builtin::poplsb(occ);
+                    value += float_network.feature_weights[feature_index(perspective, board.at(sq), sq) * L1_SIZE + neuron];
+                }
+                output += std::clamp(value, 0., 1.) * float_network.output_weights[i * L1_SIZE + neuron];
+            }
+        }
+
+        output *= SCALE;
+        return dual_perspective || board.sideToMove() == chess::Color::WHITE ? output : -output;
+    }
+
     void Board::setFen(const std::string& fen) {
         setFenInternal(fen);
-        if (prophet) {
-            prophet_reset(prophet);
-            prophet_activate_all(prophet,
-                {
-                    .white = us(chess::Color::WHITE),
-                    .black = us(chess::Color::BLACK),
-                    .pawns = pieces(chess::PieceType::PAWN),
-                    .knights = pieces(chess::PieceType::KNIGHT),
-                    .bishops = pieces(chess::PieceType::BISHOP),
-                    .rooks = pieces(chess::PieceType::ROOK),
-                    .queens = pieces(chess::PieceType::QUEEN),
-                    .kings = pieces(chess::PieceType::KING),
-                    .side_to_move = (uint8_t) side_to_move_,
-                });
-        }
-    }
-
-    void Board::accept_prophet(Prophet* new_prophet) {
-        if (prophet) {
-            prophet_die_for_sins(prophet);
-        }
-        prophet = new_prophet;
-        prophet_reset(prophet);
-        prophet_activate_all(prophet,
-            {
-                .white = us(chess::Color::WHITE),
-                .black = us(chess::Color::BLACK),
-                .pawns = pieces(chess::PieceType::PAWN),
-                .knights = pieces(chess::PieceType::KNIGHT),
-                .bishops = pieces(chess::PieceType::BISHOP),
-                .rooks = pieces(chess::PieceType::ROOK),
-                .queens = pieces(chess::PieceType::QUEEN),
-                .kings = pieces(chess::PieceType::KING),
-                .side_to_move = (uint8_t) side_to_move_,
-            });
-    }
-
-    Prophet* Board::release_prophet() {
-        return std::exchange(prophet, nullptr);
-    }
-
-    void Board::placePiece(chess::Piece piece, chess::Square sq) {
-        if (prophet) prophet_activate(prophet, (int32_t) chess::utils::typeOfPiece(piece), (int32_t) color(piece), sq);
-        chess::Board::placePiece(piece, sq);
-    }
-
-    void Board::removePiece(chess::Piece piece, chess::Square sq) {
-        if (prophet) prophet_deactivate(prophet, (int32_t) chess::utils::typeOfPiece(piece), (int32_t) color(piece), sq);
-        chess::Board::removePiece(piece, sq);
-    }
-
-    Board::~Board() {
-        if (prophet) {
-            prophet_die_for_sins(prophet);
+        reset_accumulators();
+    }
+
+    void Board::reserve_accumulators(size_t capacity) {
+        // Default-initialized, so only the bookkeeping of each entry is written
+        std::unique_ptr<AccumulatorEntry[]> new_accumulators(new AccumulatorEntry[capacity]);
+        std::copy(accumulators.get(), accumulators.get() + accumulator_count, new_accumulators.get());
+        accumulators = std::move(new_accumulators);
+        accumulator_capacity = capacity;
+    }
+
+    void Board::copy_accumulators(const Board& board) {
+        if (accumulator_capacity < board.accumulator_count + ACCUMULATOR_HEADROOM) {
+            accumulator_count = 0;
+            reserve_accumulators(board.accumulator_count + ACCUMULATOR_HEADROOM);
+        }
+        std::copy(board.accumulators.get(), board.accumulators.get() + board.accumulator_count, accumulators.get());
+        accumulator_count = board.accumulator_count;
+    }
+
+    void Board::reset_accumulators() {
+        if (accumulator_capacity < 1 + ACCUMULATOR_HEADROOM) {
+            accumulator_count = 0;
+            reserve_accumulators(1 + ACCUMULATOR_HEADROOM);
+        }
+        accumulator_count = 1;
+        AccumulatorEntry& entry = accumulators[0];
+        entry.dirty.added_count = 0;
+        entry.dirty.removed_count = 0;
+        refresh(entry.accumulator, *this);
+        entry.computed = true;
+    }
+
+    // Walks back to the last computed accumulator and replays the dirty features from there
+    void Board::update_accumulators() const {
+        // Only the perspectives the network reads are copied, which for mono-accumulator networks is half the accumulator
+        int perspectives = loaded_network.dual_perspective ? 2 : 1;
+
+        size_t i = accumulator_count - 1;
+        while (!accumulators[i].computed) {
+            --i;
+        }
+
+        for (++i; i < accumulator_count; ++i) {
+            AccumulatorEntry& entry = accumulators[i];
+            for (int perspective = 0; perspective < perspectives; ++perspective) {
+                std::copy(std::begin(accumulators[i - 1].accumulator.values[perspective]), std::end(accumulators[i - 1].accumulator.values[perspective]), entry.accumulator.values[perspective]);
+            }
+            for (uint8_t j = 0; j < entry.dirty.removed_count; ++j) {
+                deactivate(entry.accumulator, entry.dirty.removed[j].piece, entry.dirty.removed[j].sq);
+            }
+            for (uint8_t j = 0; j < entry.dirty.added_count; ++j) {
+                activate(entry.accumulator, entry.dirty.added[j].piece, entry.dirty.added[j].sq);
+            }
+            entry.computed = true;
         }
     }
 } // namespace nnue
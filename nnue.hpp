@@ -1,32 +1,186 @@
 #pragma once
 
 #include "chess.hpp"
-#include <prophet.h>
+#include <cassert>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace nnue {
+    constexpr int INPUT_SIZE = 768; // 2 colors * 6 piece types * 64 squares
+    constexpr int L1_SIZE = 256;
+    constexpr int QA = 64;     // Feature transformer quantization
+    constexpr int QB = 64;     // Output layer quantization
+    constexpr int SCALE = 400; // Network output to centipawns
+
+    enum class SIMDLevel {
+        SCALAR,
+        SSE41,
+        AVX2,
+    };
+
+    struct alignas(64) Network {
+        int16_t feature_weights[INPUT_SIZE][L1_SIZE];
+        int16_t feature_bias[L1_SIZE];
+        // Side to move half followed by the other side's half for dual-perspective networks,
+        // or just the white half for mono-accumulator networks
+        int16_t output_weights[2 * L1_SIZE];
+        int32_t output_bias;
+        bool dual_perspective;
+    };
+
+    // Holds the hidden layer as seen from both white's and black's perspective, so
+    // flipping the side to move never requires recomputation
+    struct alignas(64) Accumulator {
+        int16_t values[2][L1_SIZE];
+    };
+
+    // Loads the embedded network on first use
+    const Network& network();
+
+    SIMDLevel simd_level();
+    bool simd_level_supported(SIMDLevel level);
+    void set_simd_level(SIMDLevel level);
+    std::string simd_level_name(SIMDLevel level);
+
+    // From black's perspective the board is mirrored vertically and the colors are swapped
+    inline int feature_index(chess::Color perspective, chess::Piece piece, chess::Square sq) {
+        chess::Color color = chess::Board::color(piece);
+        if (perspective == chess::Color::BLACK) {
+            color = ~color;
+            sq = chess::Square(sq ^ 56);
+        }
+        return ((int) color * 6 + (int) chess::utils::typeOfPiece(piece)) * 64 + sq;
+    }
+
+    void refresh(Accumulator& accumulator, const chess::Board& board);
+    void activate(Accumulator& accumulator, chess::Piece piece, chess::Square sq);
+    void deactivate(Accumulator& accumulator, chess::Piece piece, chess::Square sq);
+
+    // Evaluates the position from the perspective of side_to_move
+    int evaluate(const Accumulator& accumulator, chess::Color side_to_move);
+
+    // Unquantized floating point evaluation straight from the network file, which the
+    // quantized evaluation is checked against
+    double reference_evaluate(const chess::Board& board);
+
+    // Feature changes made by a move that haven't been applied to its accumulator yet
+    struct DirtyFeatures {
+        struct Feature {
+            chess::Piece piece;
+            chess::Square sq;
+        };
+
+        Feature added[2];
+        Feature removed[2];
+        uint8_t added_count = 0;
+        uint8_t removed_count = 0;
+    };
+
+    // Free entries a board keeps above its current position, which is more than most searches go deep
+    constexpr size_t ACCUMULATOR_HEADROOM = 64;
+
+    struct AccumulatorEntry {
+        Accumulator accumulator;
+        DirtyFeatures dirty;
+        bool computed = false;
+    };
+
+    // Keeps one accumulator per ply, so unmaking a move just pops the stack
+    // instead of reversing the feature updates. Moves only record which features
+    // changed, and the accumulator is brought up to date once the position is evaluated
     class Board : public chess::Board {
     public:
         Board():
-            chess::Board() {}
+            chess::Board() {
+            reset_accumulators();
+        }
         Board(const std::string& fen = chess::STARTPOS):
-            chess::Board(fen) {}
+            chess::Board(fen) {
+            reset_accumulators();
+        }
+
+        Board(const Board& board):
+            chess::Board(board) {
+            copy_accumulators(board);
+        }
+
+        Board& operator=(const Board& board) {
+            // copy_accumulators may reallocate the stack it would be reading from
+            if (this != &board) {
+                chess::Board::operator=(board);
+                copy_accumulators(board);
+            }
+            return *this;
+        }
 
         void setFen(const std::string& fen) override;
 
-        void accept_prophet(Prophet* new_prophet);
-        Prophet* release_prophet();
+        inline void makeMove(const chess::Move& move) {
+            push_accumulator();
+            chess::Board::makeMove(move, *this);
+        }
 
-        inline Prophet* get_prophet() const {
-            return prophet;
+        // The previous accumulator is still on the stack, so unmaking doesn't need to observe anything
+        inline void unmakeMove(const chess::Move& move) {
+            --accumulator_count;
+            chess::Board::unmakeMove(move);
         }
 
-        ~Board();
+        // Null moves don't change any features, so they don't touch the stack
+        inline void makeNullMove() {
+            chess::Board::makeNullMove();
+        }
+
+        inline void unmakeNullMove() {
+            chess::Board::unmakeNullMove();
+        }
+
+        inline int evaluate() const {
+            if (!accumulators[accumulator_count - 1].computed) {
+                update_accumulators();
+            }
+            return nnue::evaluate(accumulators[accumulator_count - 1].accumulator, side_to_move_);
+        }
 
     protected:
-        Prophet* prophet = nullptr;
+        friend class chess::Board;
+
+        // Mutable because evaluating a position materializes its accumulator.
+        // Entries above accumulator_count are left uninitialized until they're pushed
+        mutable std::unique_ptr<AccumulatorEntry[]> accumulators;
+        size_t accumulator_count = 0;
+        size_t accumulator_capacity = 0;
+
+        // Only resets the bookkeeping, since the accumulator itself is written once it's computed
+        inline void push_accumulator() {
+            if (accumulator_count == accumulator_capacity) {
+                reserve_accumulators(accumulator_capacity * 2);
+            }
+            AccumulatorEntry& entry = accumulators[accumulator_count++];
+            entry.dirty.added_count = 0;
+            entry.dirty.removed_count = 0;
+            entry.computed = false;
+        }
 
-        void placePiece(chess::Piece piece, chess::Square sq) override;
-        void removePiece(chess::Piece piece, chess::Square sq) override;
+        void reserve_accumulators(size_t capacity);
+        void copy_accumulators(const Board& board);
+        void reset_accumulators();
+        void update_accumulators() const;
+
+        // Called by chess::Board::makeMove for every piece the move places or removes, always
+        // right after push_accumulator, so the changes are only ever recorded
+        inline void piecePlaced(chess::Piece piece, chess::Square sq) {
+            DirtyFeatures& dirty = accumulators[accumulator_count - 1].dirty;
+            assert(dirty.added_count < 2);
+            dirty.added[dirty.added_count++] = {piece, sq};
+        }
+
+        inline void pieceRemoved(chess::Piece piece, chess::Square sq) {
+            DirtyFeatures& dirty = accumulators[accumulator_count - 1].dirty;
+            assert(dirty.removed_count < 2);
+            dirty.removed[dirty.removed_count++] = {piece, sq};
+        }
     };
 } // namespace nnue
@@ -1,31 +1,132 @@
 #include "search.hpp"
 #include "evaluation.hpp"
 #include "util.hpp"
-#include <boost/range/adaptor/indexed.hpp>
 #include <cmath>
 #include <stdexcept>
 
 ADD_INCR_OPERATORS_FOR(chess::Square);
 
-int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, std::function<bool(int)> is_stopping, bool do_null_move, bool do_lmr) {
-    if (is_stopping(info.starting_depth)) {
+std::vector<RootMove> SearchAgent::get_root_moves(const chess::Board& board) const {
+    std::vector<RootMove> root_moves;
+    const PieceToHistory* continuation_histories[2] = {nullptr, nullptr};
+    MovePicker picker(board, chess::Move(0), killer_moves[(uint8_t) board.sideToMove()][0], chess::Move(0), history_scores, continuation_histories, capture_history);
+    chess::Move move;
+    while ((move = picker.next()) != chess::Move(0)) {
+        root_moves.emplace_back(move);
+    }
+    return root_moves;
+}
+
+int SearchAgent::search_root(nnue::Board& board, std::vector<RootMove>& root_moves, SearchInfo& info, int last_score, bool full_window, uint8_t multipv, const StopCondition& stop) {
+    if (full_window || multipv > 1) {
+        return alpha_beta_root(board, root_moves, -get_value(chess::PieceType::KING), get_value(chess::PieceType::KING), info, stop, multipv);
+    }
+
+    int lower_window_size = std::round((-150.f / (1.f + std::exp(-((info.starting_depth - 1) / 3.f)))) + 175.f);
+    int upper_window_size = std::round((-150.f / (1.f + std::exp(-((info.starting_depth - 1) / 3.f)))) + 175.f);
+    for (;;) {
+        int alpha = last_score - lower_window_size;
+        int beta = last_score + upper_window_size;
+
+        int score = alpha_beta_root(board, root_moves, alpha, beta, info, stop, 1);
+        if (stop.is_stopping(info.starting_depth)) {
+            return score;
+        }
+
+        if (score <= alpha) {
+            lower_window_size <<= 1;
+        } else if (score >= beta) {
+            upper_window_size <<= 1;
+        } else {
+            return score;
+        }
+    }
+}
+
+int SearchAgent::alpha_beta_root(nnue::Board& board, std::vector<RootMove>& root_moves, int alpha, int beta, SearchInfo& info, const StopCondition& stop, uint8_t multipv) {
+    for (auto& root_move : root_moves) {
+        root_move.score = RootMove::NO_SCORE;
+    }
+
+    for (size_t i = 0; i < root_moves.size(); ++i) {
+        // Once the lines to report have been filled, the other moves only need to be
+        // shown to be no better than the worst of them
+        int bound = i < multipv ? alpha : std::max(alpha, root_moves[multipv - 1].score);
+
+        unsigned long long nodes_before = info.nodes;
+        search_stack[0] = {root_moves[i].move, board.at(root_moves[i].move.from())};
+        board.makeMove(root_moves[i].move);
+        ++info.nodes;
+
+        // Principle variation search
+        int score;
+        if (i < multipv) {
+            score = -alpha_beta(board, -beta, -alpha, info.starting_depth - 1, info, stop);
+        } else {
+            score = -alpha_beta(board, -bound - 1, -bound, info.starting_depth - 1, info, stop);
+            if (bound < score && score < beta) {
+                score = -alpha_beta(board, -beta, -bound, info.starting_depth - 1, info, stop);
+            }
+        }
+
+        board.unmakeMove(root_moves[i].move);
+
+        // The score of an interrupted search can't be trusted, but the moves searched before it can
+        if (stop.is_stopping(info.starting_depth)) {
+            break;
+        }
+
+        root_moves[i].nodes = info.nodes - nodes_before;
+        if (i < multipv || score > bound) {
+            root_moves[i].score = score;
+
+            // Searched moves are kept sorted, so the best line is always at the front
+            for (size_t j = i; j > 0 && root_moves[j].score > root_moves[j - 1].score; --j) {
+                std::swap(root_moves[j], root_moves[j - 1]);
+            }
+
+            if (score >= beta) {
+                break;
+            }
+        }
+    }
+
+    return root_moves[0].score;
+}
+
+int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, const StopCondition& stop, bool do_null_move, bool do_lmr, const chess::Move& excluded_move) {
+    ORCA_VERIFY_HASH(board);
+
+    stop.poll(info.nodes);
+    if (stop.is_stopping(info.starting_depth)) {
         return 0;
     }
 
     int mate_value = get_value(chess::PieceType::KING) - info.current_ply(board.fullMoveNumber());
 
-    chess::GameResult result;
-    if ((result = board.isGameOver().second) != chess::GameResult::NONE) {
-        switch (result) {
-        case chess::GameResult::WIN:
-        case chess::GameResult::NONE:
-            throw std::logic_error("Invalid game result");
+    bool in_check = board.inCheck();
 
-        case chess::GameResult::LOSE:
-            return -mate_value;
+    // Draws are spotted without generating moves, while checkmate and stalemate are detected
+    // once the move picker turns out to have nothing to hand out (or at the horizon)
+    if (board.isRepetition() || board.isInsufficientMaterial()) {
+        return 0;
+    } else if (board.halfMoveClock() >= 100) {
+        // Checkmate takes precedence over the fifty-move rule
+        if (in_check) {
+            chess::Movelist moves;
+            chess::movegen::legalmoves(moves, board);
+            if (moves.empty()) {
+                return -mate_value;
+            }
+        }
+        return 0;
+    }
 
-        case chess::GameResult::DRAW:
-            return 0;
+    // If a repetition is one move away, this side can always settle for a draw
+    if (alpha < 0 && board.hasGameCycle(info.current_ply(board.fullMoveNumber()))) {
+        alpha = 0;
+        if (alpha >= beta) {
+            return alpha;
         }
     }
 
@@ -36,30 +137,30 @@ int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth,
         return alpha;
     }
 
-    bool in_check = board.inCheck();
-
     // Check extensions
     if (in_check) {
         ++depth;
     }
 
     chess::Move hash_move(0);
-    TTEntry* entry;
-    if ((entry = tt->probe(board.zobrist()))) {
-        if (entry->depth >= depth) {
-            if (entry->flag == TT_FLAG_EXACT) {
-                return entry->score;
-            } else if (entry->flag == TT_FLAG_LOWERBOUND) {
-                alpha = std::max(alpha, entry->score);
-            } else if (entry->flag == TT_FLAG_UPPERBOUND) {
-                beta = std::min(beta, entry->score);
+    TTEntry entry;
+    bool tt_hit;
+    if ((tt_hit = tt->probe(board.hash(), entry))) {
+        // The entry doesn't account for the excluded move, so it can't end a search that leaves it out
+        if (entry.depth >= depth && excluded_move == chess::Move(0)) {
+            if (entry.flag == TT_FLAG_EXACT) {
+                return entry.score;
+            } else if (entry.flag == TT_FLAG_LOWERBOUND) {
+                alpha = std::max(alpha, entry.score);
+            } else if (entry.flag == TT_FLAG_UPPERBOUND) {
+                beta = std::min(beta, entry.score);
             }
 
             if (alpha >= beta) {
-                return entry->score;
+                return entry.score;
             }
         }
-        hash_move = entry->best_move;
+        hash_move = entry.best_move;
     }
 
     if (info.current_ply(board.fullMoveNumber()) > info.seldepth) {
@@ -67,24 +168,31 @@ int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth,
     }
 
     if (depth <= 0) {
-        return quiesce(board, alpha, beta, depth - 1, info, is_stopping);
+        // The move picker never runs at the horizon, so checkmate and stalemate are looked for here
+        chess::Movelist moves;
+        chess::movegen::legalmoves(moves, board);
+        if (moves.empty()) {
+            return in_check ? -mate_value : 0;
+        }
+        return quiesce(board, alpha, beta, depth - 1, info, stop);
     }
 
     bool is_pv = alpha != beta - 1;
     int evaluation = evaluate_nnue(board);
 
     // Reverse futility pruning
-    if (!is_pv && !in_check && depth <= 8 && evaluation - (120 * depth) >= beta) {
+    if (!is_pv && !in_check && excluded_move == chess::Move(0) && depth <= 8 && evaluation - (120 * depth) >= beta) {
         return evaluation;
     }
 
     // Null move pruning
-    if (do_null_move && !is_pv && !in_check && depth >= 2 && evaluation >= beta && has_non_pawn_material(board, board.sideToMove())) {
+    if (do_null_move && !is_pv && !in_check && excluded_move == chess::Move(0) && depth >= 2 && evaluation >= beta && has_non_pawn_material(board, board.sideToMove())) {
+        search_stack[info.current_ply(board.fullMoveNumber())] = {chess::Move(0), chess::Piece::NONE};
         board.makeNullMove();
-        int score = -alpha_beta(board, -beta, -beta + 1, depth - 1 - (3 + (depth - 2) / 4), info, is_stopping, false, false);
+        int score = -alpha_beta(board, -beta, -beta + 1, depth - 1 - (3 + (depth - 2) / 4), info, stop, false, false);
         board.unmakeNullMove();
 
-        if (is_stopping(info.starting_depth)) {
+        if (stop.is_stopping(info.starting_depth)) {
             return 0;
         }
 
@@ -93,126 +201,122 @@ int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth,
         }
     }
 
-    chess::Movelist moves;
-    chess::movegen::legalmoves(moves, board);
-
-    if (moves.size() > 1) {
-        for (auto& move : moves) {
-            int16_t score = 0;
-            bool capture;
-
-            if (entry && move == hash_move) {
-                score = 25000;
-                goto set_score;
-            }
-
-            capture = move.typeOf() == chess::Move::ENPASSANT ||
-                      board.at(move.to()) != chess::Piece::NONE;
-
-            if (!capture) {
-                if (is_killer_move(move, board.sideToMove(), info.current_ply(board.fullMoveNumber()))) {
-                    score = 2;
-                } else if (move.typeOf() == chess::Move::CASTLING) {
-                    score = 1;
-                } else {
-                    score = -30000 + get_history_score(move);
-                }
-                goto set_score;
-            }
-
-            if (capture) {
-                if (move.typeOf() == chess::Move::ENPASSANT) {
-                    score = 10;
-                    goto set_score;
-                }
-
-                score += mvv_lva(board, move);
-
-                if (move.typeOf() == chess::Move::PROMOTION || see(board, move) >= -100) {
-                    score += 10;
-                } else {
-                    score -= 30001;
-                }
-            }
-
-            if (move.typeOf() == chess::Move::PROMOTION) {
-                switch (move.promotionType()) {
-                case chess::PieceType::KNIGHT:
-                    score += 5000;
-                    break;
-                case chess::PieceType::BISHOP:
-                    score += 6000;
-                    break;
-                case chess::PieceType::ROOK:
-                    score += 7000;
-                    break;
-                case chess::PieceType::QUEEN:
-                    score += 8000;
-                    break;
-                default:
-                    throw std::logic_error("Invalid promotion");
-                }
-            }
+    int ply = info.current_ply(board.fullMoveNumber());
+    PieceToHistory* continuation_histories[2];
+    get_continuation_histories(ply, continuation_histories);
+    MovePicker picker(board, hash_move, killer_moves[(uint8_t) board.sideToMove()][ply], get_counter_move(ply), history_scores, continuation_histories, capture_history);
+
+    // Singular extensions: if no other move comes close to the TT move's score in a reduced
+    // search, the TT move is the only good one here and is worth looking at more deeply
+    int singular_extension = 0;
+    if (picker.has_tt_move() &&
+        excluded_move == chess::Move(0) &&
+        depth >= SINGULAR_MIN_DEPTH &&
+        ply < 2 * info.starting_depth &&
+        (entry.flag == TT_FLAG_LOWERBOUND || entry.flag == TT_FLAG_EXACT) &&
+        entry.depth >= depth - 3 &&
+        std::abs(entry.score) < get_value(chess::PieceType::KING) - 1024) {
+        int singular_beta = entry.score - 2 * depth;
+        int score = alpha_beta(board, singular_beta - 1, singular_beta, (depth - 1) / 2, info, stop, false, true, hash_move);
+
+        if (stop.is_stopping(info.starting_depth)) {
+            return 0;
+        }
 
-        set_score:
-            move.setScore(score);
+        if (score < singular_beta) {
+            singular_extension = 1;
+        } else if (singular_beta >= beta) {
+            // Multi-cut: even without the TT move, another move beats beta
+            return singular_beta;
         }
-        moves.sort();
     }
 
     long long lmr_index = std::round(6.f / (1.f + std::exp(info.starting_depth / 4.f))) + 3;
     chess::Move best_move(0);
     int original_alpha = alpha;
-    for (auto move : moves | boost::adaptors::indexed()) {
-        bool capture = move.value().typeOf() == chess::Move::ENPASSANT ||
-                       board.at(move.value().to()) != chess::Piece::NONE;
+    chess::Move move;
+    bool searched = false;
+    chess::Movelist quiets_searched;
+    chess::Movelist captures_searched;
+    for (int move_index = 0; (move = picker.next()) != chess::Move(0); ++move_index) {
+        if (move == excluded_move) {
+            --move_index;
+            continue;
+        }
+        searched = true;
+        bool capture = move.typeOf() == chess::Move::ENPASSANT ||
+                       board.at(move.to()) != chess::Piece::NONE;
+        bool tactical = is_tactical(board, move);
 
         int score;
-        board.makeMove(move.value());
+        search_stack[ply] = {move, board.at(move.from())};
+        board.makeMove(move);
         ++info.nodes;
 
         // Late move reductions
-        if (do_lmr && moves.size() > 1 && depth >= 2 && move.index() > lmr_index && !capture) {
-            score = -alpha_beta(board, -alpha - 1, -alpha, depth - 1 - std::round(std::log(move.index() - (lmr_index - 1)) * std::log(depth)), info, is_stopping, true, false);
+        if (do_lmr && depth >= 2 && move_index > lmr_index && !capture) {
+            int reduced_depth = std::max<int>(depth - 1 - std::round(std::log(move_index - (lmr_index - 1)) * std::log(depth)), 0);
+            score = -alpha_beta(board, -alpha - 1, -alpha, reduced_depth, info, stop, true, false);
             if (score <= alpha) {
                 goto unmake_move;
             }
         }
 
         // Principle variation search
-        if (!entry || move.value() == hash_move || moves[0] != hash_move) {
-            score = -alpha_beta(board, -beta, -alpha, depth - 1, info, is_stopping, true, do_lmr);
+        if (!picker.has_tt_move() || move == hash_move) {
+            score = -alpha_beta(board, -beta, -alpha, depth - 1 + (move == hash_move ? singular_extension : 0), info, stop, true, do_lmr);
         } else {
-            score = -alpha_beta(board, -alpha - 1, -alpha, depth - 1, info, is_stopping, true, do_lmr);
+            score = -alpha_beta(board, -alpha - 1, -alpha, depth - 1, info, stop, true, do_lmr);
             if (alpha < score && score < beta) {
-                score = -alpha_beta(board, -beta, -alpha, depth - 1, info, is_stopping, true, do_lmr);
+                score = -alpha_beta(board, -beta, -alpha, depth - 1, info, stop, true, do_lmr);
             }
         }
 
     unmake_move:
-        board.unmakeMove(move.value());
+        board.unmakeMove(move);
 
-        if (is_stopping(info.starting_depth)) {
+        if (stop.is_stopping(info.starting_depth)) {
             return 0;
         }
 
         if (score >= beta) {
+            if (tactical) {
+                update_capture_history(board, move, history_bonus(depth));
+            }
+            if (!tactical) {
+                add_killer_move(move, board.sideToMove(), ply);
+                update_quiet_histories(board, move, quiets_searched, depth, ply);
+            }
+            for (const auto& earlier_capture : captures_searched) {
+                update_capture_history(board, earlier_capture, -history_bonus(depth));
+            }
             alpha = beta;
-            best_move = move.value();
+            best_move = move;
             break;
         }
 
         if (score > alpha) {
             alpha = score;
-            if (!capture) {
-                add_killer_move(move.value(), board.sideToMove(), info.current_ply(board.fullMoveNumber()));
-                update_history_score(move.value(), depth);
-            }
-            best_move = move.value();
+            best_move = move;
+        }
+
+        if (tactical) {
+            captures_searched.add(move);
+        }
+        if (!tactical) {
+            quiets_searched.add(move);
         }
     }
 
-    if (!is_stopping(info.starting_depth)) {
+    if (!searched) {
+        // Without the excluded move there may be nothing left, which says nothing about the position
+        if (excluded_move != chess::Move(0)) {
+            return alpha;
+        }
+        return in_check ? -mate_value : 0;
+    }
+
+    if (!stop.is_stopping(info.starting_depth) && excluded_move == chess::Move(0)) {
         TTEntryFlag flag;
         if (alpha <= original_alpha) {
             flag = TT_FLAG_UPPERBOUND;
@@ -222,23 +326,17 @@ int SearchAgent::alpha_beta(nnue::Board& board, int alpha, int beta, int depth,
             flag = TT_FLAG_EXACT;
         }
 
-        if (entry) {
-            if (depth >= entry->depth) {
-                entry->score = alpha;
-                entry->depth = depth;
-                entry->best_move = best_move;
-                entry->flag = flag;
-            }
-        } else {
-            tt->insert(TTEntry(board.zobrist(), alpha, depth, best_move, flag));
-        }
+        tt->insert(TTEntry(board.hash(), alpha, depth, best_move, flag));
     }
 
     return alpha;
 }
 
-int SearchAgent::quiesce(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, std::function<bool(int)> is_stopping) {
-    if (is_stopping(info.starting_depth)) {
+int SearchAgent::quiesce(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, const StopCondition& stop) {
+    ORCA_VERIFY_HASH(board);
+
+    stop.poll(info.nodes);
+    if (stop.is_stopping(info.starting_depth)) {
         return 0;
     }
 
@@ -250,78 +348,24 @@ int SearchAgent::quiesce(nnue::Board& board, int alpha, int beta, int depth, Sea
         alpha = evaluation;
     }
 
-    chess::Movelist moves;
-    chess::movegen::legalmoves<chess::MoveGenType::CAPTURE>(moves, board);
-
-    if (moves.empty()) {
-        return evaluation;
-    }
-
     chess::Move hash_move(0);
-    if (TTEntry* entry = tt->probe(board.zobrist())) {
-        hash_move = entry->best_move;
+    TTEntry entry;
+    if (tt->probe(board.hash(), entry)) {
+        hash_move = entry.best_move;
     }
 
-    if (moves.size() > 1) {
-        for (auto& move : moves) {
-            int16_t score = 0;
-            bool capture;
-
-            if (move == hash_move) {
-                score = 25000;
-                goto set_score;
-            }
-
-            capture = move.typeOf() == chess::Move::ENPASSANT ||
-                      board.at(move.to()) != chess::Piece::NONE;
-
-            if (capture) {
-                if (move.typeOf() == chess::Move::ENPASSANT) {
-                    score = 10;
-                    goto set_score;
-                }
-
-                score += mvv_lva(board, move);
+    MovePicker picker(board, hash_move, capture_history);
 
-                if (move.typeOf() == chess::Move::PROMOTION || see(board, move) >= -100) {
-                    score += 10;
-                } else {
-                    score -= 30001;
-                }
-            }
-
-            if (move.typeOf() == chess::Move::PROMOTION) {
-                switch (move.promotionType()) {
-                case chess::PieceType::KNIGHT:
-                    score += 5000;
-                    break;
-                case chess::PieceType::BISHOP:
-                    score += 6000;
-                    break;
-                case chess::PieceType::ROOK:
-                    score += 7000;
-                    break;
-                case chess::PieceType::QUEEN:
-                    score += 8000;
-                    break;
-                default:
-                    throw std::logic_error("Invalid promotion");
-                }
-            }
-
-        set_score:
-            move.setScore(score);
-        }
-        moves.sort();
-    }
-
-    for (const auto& move : moves) {
+    chess::Move move;
+    bool searched = false;
+    while ((move = picker.next()) != chess::Move(0)) {
+        searched = true;
         board.makeMove(move);
         ++info.nodes;
-        int score = -quiesce(board, -beta, -alpha, depth - 1, info, is_stopping);
+        int score = -quiesce(board, -beta, -alpha, depth - 1, info, stop);
         board.unmakeMove(move);
 
-        if (is_stopping(info.starting_depth)) {
+        if (stop.is_stopping(info.starting_depth)) {
             return 0;
         }
 
@@ -335,6 +379,9 @@ int SearchAgent::quiesce(nnue::Board& board, int alpha, int beta, int depth, Sea
         }
     }
 
+    if (!searched) {
+        return evaluation;
+    }
     return alpha;
 }
 
@@ -361,29 +408,98 @@ int SearchAgent::get_history_score(const chess::Move& move) const {
     return history_scores[move.from()][move.to()];
 }
 
-void SearchAgent::update_history_score(const chess::Move& move, int depth) {
-    history_scores[move.from()][move.to()] += depth * depth;
-    if (history_scores[move.from()][move.to()] >= 30000) {
-        for (chess::Square sq1 = chess::SQ_A1; sq1 < chess::NO_SQ; ++sq1) {
-            for (chess::Square sq2 = chess::SQ_A1; sq2 < chess::NO_SQ; ++sq2) {
-                history_scores[sq1][sq2] >>= 1; // Divide by two
+void SearchAgent::get_continuation_histories(int ply, PieceToHistory* (&ret)[2]) {
+    for (int i = 0; i < 2; ++i) {
+        ret[i] = nullptr;
+        if (ply > i) {
+            const PlyMove& earlier = search_stack[ply - 1 - i];
+            if (earlier.piece != chess::Piece::NONE) {
+                ret[i] = &continuation_histories[i][(int) earlier.piece][earlier.move.to()];
+            }
+        }
+    }
+}
+
+chess::Move SearchAgent::get_counter_move(int ply) const {
+    if (ply > 0 && search_stack[ply - 1].piece != chess::Piece::NONE) {
+        return counter_moves[(int) search_stack[ply - 1].piece][search_stack[ply - 1].move.to()];
+    }
+    return chess::Move(0);
+}
+
+void SearchAgent::update_quiet_histories(const chess::Board& board, const chess::Move& move, const chess::Movelist& quiets_searched, int depth, int ply) {
+    PieceToHistory* continuation_histories[2];
+    get_continuation_histories(ply, continuation_histories);
+    const auto update_all = [this, &board, &continuation_histories](const chess::Move& move, int bonus) {
+        update_history(history_scores[move.from()][move.to()], bonus);
+        for (auto continuation_history : continuation_histories) {
+            if (continuation_history) {
+                update_history((*continuation_history)[(int) board.at(move.from())][move.to()], bonus);
             }
         }
+    };
+
+    int bonus = history_bonus(depth);
+    update_all(move, bonus);
+    for (const auto& quiet : quiets_searched) {
+        update_all(quiet, -bonus);
+    }
+
+    if (ply > 0 && search_stack[ply - 1].piece != chess::Piece::NONE) {
+        counter_moves[(int) search_stack[ply - 1].piece][search_stack[ply - 1].move.to()] = move;
     }
 }
 
+void SearchAgent::update_capture_history(const chess::Board& board, const chess::Move& move, int bonus) {
+    update_history(capture_history[(int) board.at(move.from())][move.to()][(int) captured_type(board, move)], bonus);
+}
+
+TimeManager::TimeManager(std::chrono::milliseconds time, std::chrono::milliseconds increment, int moves_to_go) {
+    std::chrono::milliseconds available = std::max(time - MOVE_OVERHEAD, std::chrono::milliseconds(1));
+    if (moves_to_go <= 0) {
+        moves_to_go = DEFAULT_MOVES_TO_GO;
+    } else {
+        moves_to_go = std::min(moves_to_go, DEFAULT_MOVES_TO_GO);
+    }
+
+    // The increment is only counted in part, as it isn't ours until the move has been made
+    soft_limit = available / moves_to_go + increment * 3 / 4;
+    hard_limit = std::min(soft_limit * 4, available * 3 / 4);
+    soft_limit = std::min(soft_limit, hard_limit);
+}
+
+bool TimeManager::should_stop(std::chrono::milliseconds elapsed, const chess::Move& best_move, int score) {
+    // How long the best move has survived, from 0 (just changed) to 4
+    static constexpr double STABILITY_SCALE[] = {2.0, 1.4, 1.1, 0.9, 0.75};
+
+    if (best_move == last_best_move) {
+        stability = std::min(stability + 1, 4);
+    } else {
+        stability = 0;
+    }
+    double score_scale = last_best_move == chess::Move(0) ? 1. : std::clamp(1. + (last_score - score) / 100., 0.8, 1.6);
+    last_best_move = best_move;
+    last_score = score;
+
+    if (fixed) {
+        return false;
+    }
+    return elapsed.count() >= soft_limit.count() * STABILITY_SCALE[stability] * score_scale;
+}
+
 std::vector<chess::Move> get_pv(chess::Board board, const TT& tt) {
     std::vector<chess::Move> ret;
 
     while (board.fullMoveNumber() < 1024) {
         chess::Movelist moves;
         chess::movegen::legalmoves(moves, board);
-        if (const TTEntry* entry = tt.probe(board.zobrist())) {
-            if (std::find(moves.begin(), moves.end(), entry->best_move) == moves.end()) {
+        TTEntry entry;
+        if (tt.probe(board.hash(), entry)) {
+            if (std::find(moves.begin(), moves.end(), entry.best_move) == moves.end()) {
                 break;
             } else {
-                ret.push_back(entry->best_move);
-                board.makeMove(entry->best_move);
+                ret.push_back(entry.best_move);
+                board.makeMove(entry.best_move);
             }
         } else {
             break;
@@ -392,3 +508,215 @@ std::vector<chess::Move> get_pv(chess::Board board, const TT& tt) {
 
     return ret;
 }
+
+void sort_root_moves(std::vector<RootMove>& root_moves) {
+    std::stable_sort(root_moves.begin(), root_moves.end(), [](const RootMove& a, const RootMove& b) {
+        if (a.score != b.score) {
+            return a.score > b.score;
+        }
+        return a.nodes > b.nodes;
+    });
+}
+
+MovePicker::MovePicker(const chess::Board& board, const chess::Move& tt_move, const chess::Move* killers, const chess::Move& counter_move, const int (*history)[chess::MAX_SQ], const PieceToHistory* const* continuation_histories, const CaptureHistory& capture_history):
+    board(board),
+    tt_move(tt_move),
+    killers(killers),
+    counter_move(counter_move),
+    history(history),
+    continuation_histories(continuation_histories),
+    capture_history(capture_history),
+    captures_only(false) {
+    validate_tt_move();
+}
+
+MovePicker::MovePicker(const chess::Board& board, const chess::Move& tt_move, const CaptureHistory& capture_history):
+    board(board),
+    tt_move(tt_move),
+    killers(nullptr),
+    counter_move(0),
+    history(nullptr),
+    continuation_histories(nullptr),
+    capture_history(capture_history),
+    captures_only(true) {
+    validate_tt_move();
+}
+
+chess::Move MovePicker::next() {
+    for (;;) {
+        switch (stage) {
+        case Stage::TT_MOVE:
+            stage = Stage::GENERATE_CAPTURES;
+            if (has_tt_move()) {
+                return tt_move;
+            }
+            break;
+
+        case Stage::GENERATE_CAPTURES:
+            if (!captures_generated) {
+                generate_captures();
+            }
+            for (auto& move : captures) {
+                int score = capture_history[(int) board.at(move.from())][move.to()][(int) captured_type(board, move)] / CAPTURE_HISTORY_DIVISOR;
+                if (move.typeOf() == chess::Move::ENPASSANT) {
+                    score += 10;
+                } else {
+                    if (board.at(move.to()) != chess::Piece::NONE) {
+                        score += mvv_lva(board, move);
+                    }
+
+                    if (move.typeOf() == chess::Move::PROMOTION) {
+                        switch (move.promotionType()) {
+                        case chess::PieceType::KNIGHT:
+                            score += 5000;
+                            break;
+                        case chess::PieceType::BISHOP:
+                            score += 6000;
+                            break;
+                        case chess::PieceType::ROOK:
+                            score += 7000;
+                            break;
+                        case chess::PieceType::QUEEN:
+                            score += 8000;
+                            break;
+                        default:
+                            throw std::logic_error("Invalid promotion");
+                        }
+                    }
+                }
+                move.setScore(score);
+            }
+            current = 0;
+            stage = Stage::GOOD_CAPTURES;
+            break;
+
+        case Stage::GOOD_CAPTURES:
+            while (current < captures.size()) {
+                select_best(captures, current);
+                chess::Move move = captures[current++];
+                if (move == tt_move) {
+                    continue;
+                }
+
+                // SEE is only worked out for captures that are actually reached
+                if (move.typeOf() == chess::Move::NORMAL && !see_ge(board, move, -100)) {
+                    captures[bad_captures_end++] = move;
+                    continue;
+                }
+                return move;
+            }
+            stage = captures_only ? Stage::BAD_CAPTURES : Stage::GENERATE_QUIETS;
+            current = 0;
+            break;
+
+        case Stage::GENERATE_QUIETS:
+            if (!quiets_generated) {
+                generate_quiets();
+            }
+            for (auto& move : quiets) {
+                int score = history[move.from()][move.to()];
+                for (int i = 0; i < 2; ++i) {
+                    if (continuation_histories[i]) {
+                        score += (*continuation_histories[i])[(int) board.at(move.from())][move.to()];
+                    }
+                }
+                move.setScore(score);
+            }
+            stage = Stage::KILLERS;
+            break;
+
+        case Stage::KILLERS:
+            while (killer_index < KILLER_COUNT) {
+                const chess::Move& killer = killers[killer_index++];
+                // Killers come from sibling positions, so they have to be checked for legality
+                if (killer != tt_move && quiets.find(killer) != -1) {
+                    return killer;
+                }
+            }
+            stage = Stage::COUNTER_MOVE;
+            break;
+
+        case Stage::COUNTER_MOVE:
+            stage = Stage::QUIETS;
+            if (counter_move != tt_move && !is_killer_move(counter_move) && quiets.find(counter_move) != -1) {
+                return counter_move;
+            }
+            break;
+
+        case Stage::QUIETS:
+            while (current < quiets.size()) {
+                select_best(quiets, current);
+                chess::Move move = quiets[current++];
+                if (move != tt_move && !is_killer_move(move) && move != counter_move) {
+                    return move;
+                }
+            }
+            stage = Stage::BAD_CAPTURES;
+            current = 0;
+            break;
+
+        case Stage::BAD_CAPTURES:
+            if (current < bad_captures_end) {
+                return captures[current++];
+            }
+            stage = Stage::DONE;
+            break;
+
+        case Stage::DONE:
+            return chess::Move(0);
+        }
+    }
+}
+
+void MovePicker::validate_tt_move() {
+    if (tt_move == chess::Move(0)) {
+        return;
+    }
+
+    // TT moves can come from hash collisions, so they're only trusted if they're generated
+    bool tactical = tt_move.typeOf() == chess::Move::PROMOTION ||
+                    tt_move.typeOf() == chess::Move::ENPASSANT ||
+                    (tt_move.typeOf() == chess::Move::NORMAL && board.at(tt_move.to()) != chess::Piece::NONE);
+    if (tactical) {
+        generate_captures();
+        if (captures.find(tt_move) == -1) {
+            tt_move = chess::Move(0);
+        }
+    } else if (!captures_only) {
+        generate_quiets();
+        if (quiets.find(tt_move) == -1) {
+            tt_move = chess::Move(0);
+        }
+    } else {
+        tt_move = chess::Move(0);
+    }
+}
+
+void MovePicker::generate_captures() {
+    chess::movegen::legalmoves<chess::MoveGenType::CAPTURE>(captures, board);
+    captures_generated = true;
+}
+
+void MovePicker::generate_quiets() {
+    chess::movegen::legalmoves<chess::MoveGenType::QUIET>(quiets, board);
+    quiets_generated = true;
+}
+
+bool MovePicker::is_killer_move(const chess::Move& move) const {
+    for (int i = 0; i < KILLER_COUNT; ++i) {
+        if (killers[i] == move) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MovePicker::select_best(chess::Movelist& moves, int index) {
+    int best = index;
+    for (int i = index + 1; i < moves.size(); ++i) {
+        if (moves[i].score() > moves[best].score()) {
+            best = i;
+        }
+    }
+    std::swap(moves[index], moves[best]);
+}
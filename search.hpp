@@ -3,10 +3,13 @@
 #include "chess.hpp"
 #include "nnue.hpp"
 #include <algorithm>
+#include <boost/atomic.hpp>
+#include <boost/fiber/unbuffered_channel.hpp>
 #include <chrono>
+#include <climits>
 #include <cstdint>
 #include <cstring>
-#include <functional>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -32,62 +35,235 @@ public:
         depth(depth),
         best_move(best_move),
         flag(flag) {}
+
+    // Packed layout: key (16) | move (16) | score (16) | depth (8) | flag (2) + generation (6)
+    // Each entry fits in a single 64-bit word, so threads can share the table without locks
+    uint64_t pack(uint8_t generation) const {
+        return key(hash) |
+               ((uint64_t) best_move.move() << 16) |
+               ((uint64_t) (uint16_t) score << 32) |
+               ((uint64_t) std::min(depth, 255) << 48) |
+               ((uint64_t) flag << 56) |
+               ((uint64_t) (generation & 0x3F) << 58);
+    }
+
+    static TTEntry unpack(chess::U64 hash, uint64_t data) {
+        return TTEntry(hash,
+            (int16_t) (data >> 32),
+            (data >> 48) & 0xFF,
+            move_of(data),
+            (TTEntryFlag) ((data >> 56) & 0b11));
+    }
+
+    static uint16_t key(chess::U64 hash) {
+        return hash & 0xFFFF;
+    }
+
+    static uint16_t key_of(uint64_t data) {
+        return data & 0xFFFF;
+    }
+
+    static chess::Move move_of(uint64_t data) {
+        return chess::Move((data >> 16) & 0xFFFF);
+    }
+
+    static TTEntryFlag flag_of(uint64_t data) {
+        return (TTEntryFlag) ((data >> 56) & 0b11);
+    }
+
+    static int depth_of(uint64_t data) {
+        return (data >> 48) & 0xFF;
+    }
+
+    static uint8_t generation_of(uint64_t data) {
+        return data >> 58;
+    }
 };
 
+// A bucket of entries that occupies exactly one cache line
+struct alignas(64) TTCluster {
+    static constexpr size_t size = 8;
+    boost::atomic<uint64_t> entries[size];
+
+    TTCluster() {
+        clear();
+    }
+
+    void clear() {
+        for (auto& entry : entries) {
+            entry.store(0, boost::memory_order_relaxed);
+        }
+    }
+};
+
+static_assert(sizeof(TTCluster) == 64, "TTCluster must fit in one cache line");
+
 class TT {
 protected:
-    std::vector<TTEntry> entries;
+    std::unique_ptr<TTCluster[]> clusters;
+    size_t cluster_count;
+    uint8_t generation = 0;
+
+    TTCluster& cluster_for(chess::U64 hash) const {
+        // Use the high bits of the hash for the index, as the low bits are stored as the key
+        return clusters[((unsigned __int128) hash * cluster_count) >> 64];
+    }
+
+    // How many searches ago an entry was last written
+    int age_of(uint64_t data) const {
+        return (generation - TTEntry::generation_of(data)) & 0x3F;
+    }
 
 public:
     TT(size_t size):
-        entries(size) {}
+        clusters(new TTCluster[std::max<size_t>(size, 1)]),
+        cluster_count(std::max<size_t>(size, 1)) {}
 
-    const TTEntry* probe(chess::U64 hash) const {
-        const TTEntry* ret = &entries[hash % size()];
-        if (ret->hash != hash) {
-            return nullptr;
+    bool probe(chess::U64 hash, TTEntry& entry) const {
+        const TTCluster& cluster = cluster_for(hash);
+        for (const auto& slot : cluster.entries) {
+            uint64_t data = slot.load(boost::memory_order_relaxed);
+            if (TTEntry::flag_of(data) != TT_FLAG_NONE && TTEntry::key_of(data) == TTEntry::key(hash)) {
+                entry = TTEntry::unpack(hash, data);
+                return true;
+            }
         }
-        return ret;
+        return false;
     }
 
-    TTEntry* probe(chess::U64 hash) {
-        TTEntry* ret = &entries[hash % size()];
-        if (ret->hash != hash) {
-            return nullptr;
+    void insert(const TTEntry& entry) {
+        TTCluster& cluster = cluster_for(entry.hash);
+
+        // Prefer replacing empty slots, then the entry with the lowest depth once
+        // its age is taken into account, so stale entries from old searches go first
+        boost::atomic<uint64_t>* replace = &cluster.entries[0];
+        int replace_worth = INT_MAX;
+        for (auto& slot : cluster.entries) {
+            uint64_t data = slot.load(boost::memory_order_relaxed);
+            if (TTEntry::flag_of(data) == TT_FLAG_NONE) {
+                replace = &slot;
+                break;
+            } else if (TTEntry::key_of(data) == TTEntry::key(entry.hash)) {
+                if (entry.depth >= TTEntry::depth_of(data) || age_of(data) || entry.flag == TT_FLAG_EXACT) {
+                    TTEntry new_entry = entry;
+                    if (new_entry.best_move == chess::Move(0)) {
+                        new_entry.best_move = TTEntry::move_of(data);
+                    }
+                    slot.store(new_entry.pack(generation), boost::memory_order_relaxed);
+                }
+                return;
+            }
+
+            int worth = TTEntry::depth_of(data) - 8 * age_of(data);
+            if (worth < replace_worth) {
+                replace = &slot;
+                replace_worth = worth;
+            }
         }
-        return ret;
+
+        replace->store(entry.pack(generation), boost::memory_order_relaxed);
     }
 
-    void insert(const TTEntry& entry) {
-        if (entry.depth >= entries[entry.hash % size()].depth) {
-            entries[entry.hash % size()] = entry;
-        }
+    // Ages every entry in the table by one search without touching memory
+    void new_search() {
+        generation = (generation + 1) & 0x3F;
     }
 
     void resize(size_t size) {
-        entries.resize(size);
+        size = std::max<size_t>(size, 1);
+        if (size != cluster_count) {
+            clusters.reset(new TTCluster[size]);
+            cluster_count = size;
+        }
     }
 
     void clear() {
-        std::fill(entries.begin(), entries.end(), TTEntry());
+        for (size_t i = 0; i < cluster_count; ++i) {
+            clusters[i].clear();
+        }
     }
 
     size_t size() const {
-        return entries.size();
+        return cluster_count * TTCluster::size;
     }
 };
 
 typedef chess::Move KillerMoves[2][1024][3];
 
+// Scores for quiet moves, indexed by the piece moved and the square it moves to
+typedef int16_t PieceToHistory[12][chess::MAX_SQ];
+// Indexed by the piece and destination of an earlier move in the line first
+typedef PieceToHistory ContinuationHistory[12][chess::MAX_SQ];
+// Scores for captures and promotions, indexed by the piece moved, its destination and the type of piece taken
+typedef int16_t CaptureHistory[12][chess::MAX_SQ][7];
+
+// The type of piece a move takes, which is NONE for quiet moves (castling included)
+inline chess::PieceType captured_type(const chess::Board& board, const chess::Move& move) {
+    if (move.typeOf() == chess::Move::ENPASSANT) {
+        return chess::PieceType::PAWN;
+    } else if (move.typeOf() == chess::Move::CASTLING) {
+        return chess::PieceType::NONE;
+    }
+    return board.at<chess::PieceType>(move.to());
+}
+
+// Whether a move is handed out with the captures rather than the quiets
+inline bool is_tactical(const chess::Board& board, const chess::Move& move) {
+    return move.typeOf() == chess::Move::PROMOTION || captured_type(board, move) != chess::PieceType::NONE;
+}
+
+struct SearchResult {
+    chess::Move best_move;
+    unsigned long long nodes;
+};
+
+// Splits the clock into a soft limit, which is checked between iterations and stretched
+// or shrunk depending on how settled the search looks, and a hard limit that aborts the search
+class TimeManager {
+public:
+    static constexpr std::chrono::milliseconds MOVE_OVERHEAD = std::chrono::milliseconds(25);
+    static constexpr int DEFAULT_MOVES_TO_GO = 30;
+
+    // For a fixed amount of time per move, all of which is used
+    TimeManager(std::chrono::milliseconds time):
+        soft_limit(time),
+        hard_limit(time),
+        fixed(true) {}
+    // For a clock, where moves_to_go is 0 if the rest of the game has to be played in the time left
+    TimeManager(std::chrono::milliseconds time, std::chrono::milliseconds increment, int moves_to_go);
+
+    std::chrono::milliseconds get_hard_limit() const {
+        return hard_limit;
+    }
+
+    // Called after every completed iteration
+    bool should_stop(std::chrono::milliseconds elapsed, const chess::Move& best_move, int score);
+
+protected:
+    std::chrono::milliseconds soft_limit;
+    std::chrono::milliseconds hard_limit;
+    bool fixed = false;
+
+    chess::Move last_best_move = chess::Move(0);
+    int last_score = 0;
+    int stability = 0;
+};
+
 struct SearchRequest {
     nnue::Board board = nnue::Board(chess::STARTPOS);
     uint8_t multipv = 1;
     uint8_t threads = 1;
     uint16_t hash_size = 64;
-    std::chrono::milliseconds time;
+    TimeManager time_manager = TimeManager(std::chrono::seconds(10));
     int target_depth = -1;
     bool new_game = false;
+    bool clear_hash = false;
+    bool ponder = false;
+    // If set, the result is also pushed here once the search is done
+    boost::fibers::unbuffered_channel<SearchResult>* results = nullptr;
     bool quit = false;
+    // Set when the request is queued
+    unsigned long long id = 0;
 };
 
 class SearchInfo {
@@ -106,32 +282,258 @@ public:
     }
 };
 
+// Decides when a search has to be abandoned. The clock is only read every
+// TIME_CHECK_INTERVAL nodes, so the check made at every node is a single relaxed load
+class StopCondition {
+public:
+    static constexpr unsigned long long TIME_CHECK_INTERVAL = 2048;
+
+    StopCondition(boost::atomic<bool>& flag, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()):
+        flag(&flag),
+        deadline(deadline) {}
+    // For Lazy SMP helpers, which have no deadline of their own but add their nodes to node_counter as they go
+    StopCondition(boost::atomic<bool>& flag, boost::atomic<unsigned long long>& node_counter):
+        flag(&flag),
+        deadline(std::chrono::steady_clock::time_point::max()),
+        node_counter(&node_counter) {}
+    // While pondering the clock isn't ours, so the time limit only starts once pondering ends
+    StopCondition(boost::atomic<bool>& flag, std::chrono::milliseconds time, const boost::atomic<bool>& pondering):
+        flag(&flag),
+        pondering(&pondering),
+        ponder_time(time) {}
+
+    // The first iteration is always finished so that there is a move to play
+    inline bool is_stopping(int starting_depth) const {
+        return starting_depth > 1 && flag->load(boost::memory_order_relaxed);
+    }
+
+    inline void poll(unsigned long long nodes) const {
+        if (nodes % TIME_CHECK_INTERVAL == 0) {
+            check_deadline();
+            publish_nodes(nodes);
+        }
+    }
+
+    // Adds the nodes searched since the last call to the node counter, if there is one
+    void publish_nodes(unsigned long long nodes) const {
+        if (node_counter && nodes > published_nodes) {
+            node_counter->fetch_add(nodes - published_nodes, boost::memory_order_relaxed);
+            published_nodes = nodes;
+        }
+    }
+
+    // Node counts start from zero every iteration
+    void end_iteration(unsigned long long nodes) const {
+        publish_nodes(nodes);
+        published_nodes = 0;
+    }
+
+    // When our clock started running, which for a ponder search is when pondering was seen to end
+    std::chrono::steady_clock::time_point get_start_time() const {
+        return start_time;
+    }
+
+    // Raises the flag once the deadline has passed
+    void check_deadline() const {
+        if (pondering) {
+            if (pondering->load(boost::memory_order_relaxed)) {
+                return;
+            }
+            start_time = std::chrono::steady_clock::now();
+            deadline = start_time + ponder_time;
+            pondering = nullptr;
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+            flag->store(true, boost::memory_order_relaxed);
+        }
+    }
+
+protected:
+    boost::atomic<bool>* flag;
+    mutable const boost::atomic<bool>* pondering = nullptr;
+    std::chrono::milliseconds ponder_time;
+    mutable std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    mutable std::chrono::steady_clock::time_point deadline;
+    boost::atomic<unsigned long long>* node_counter = nullptr;
+    mutable unsigned long long published_nodes = 0;
+};
+
+// Hands out the moves of a position one at a time, best first. Each stage only
+// generates and scores its moves once the previous stage has run dry, so nodes that
+// cut off early never pay for the rest
+class MovePicker {
+public:
+    enum class Stage : uint8_t {
+        TT_MOVE,
+        GENERATE_CAPTURES,
+        GOOD_CAPTURES,
+        GENERATE_QUIETS,
+        KILLERS,
+        COUNTER_MOVE,
+        QUIETS,
+        BAD_CAPTURES,
+        DONE,
+    };
+
+    static constexpr int KILLER_COUNT = 3;
+    // Capture history only nudges the MVV-LVA order along, since it has a far wider range
+    static constexpr int CAPTURE_HISTORY_DIVISOR = 32;
+
+    // Used by the main search. Either continuation history may be null if there's no move to follow up on
+    MovePicker(const chess::Board& board, const chess::Move& tt_move, const chess::Move* killers, const chess::Move& counter_move, const int (*history)[chess::MAX_SQ], const PieceToHistory* const* continuation_histories, const CaptureHistory& capture_history);
+    // Used by quiescence search, which only looks at captures and promotions
+    MovePicker(const chess::Board& board, const chess::Move& tt_move, const CaptureHistory& capture_history);
+
+    // Returns a null move once every move has been handed out
+    chess::Move next();
+
+    // Whether the TT move is legal here and will be (or was) handed out first
+    bool has_tt_move() const {
+        return tt_move != chess::Move(0);
+    }
+
+protected:
+    const chess::Board& board;
+    chess::Move tt_move;
+    const chess::Move* killers;
+    chess::Move counter_move;
+    const int (*history)[chess::MAX_SQ];
+    const PieceToHistory* const* continuation_histories;
+    const CaptureHistory& capture_history;
+    Stage stage = Stage::TT_MOVE;
+    bool captures_only;
+
+    chess::Movelist captures; // Bad captures are moved to the front as they're found
+    chess::Movelist quiets;
+    bool captures_generated = false;
+    bool quiets_generated = false;
+    int current = 0;
+    int bad_captures_end = 0;
+    int killer_index = 0;
+
+    void validate_tt_move();
+    void generate_captures();
+    void generate_quiets();
+    bool is_killer_move(const chess::Move& move) const;
+
+    // Partial selection sort: only the next move is put in place
+    static void select_best(chess::Movelist& moves, int index);
+};
+
+// A legal move at the root, kept across iterations so that they can be ordered by the
+// effort their subtrees took last time
+class RootMove {
+public:
+    static constexpr int NO_SCORE = INT_MIN;
+
+    chess::Move move;
+    int score = NO_SCORE; // Only set for the moves that became (one of) the best lines in the last search
+    unsigned long long nodes = 0;
+
+    RootMove(const chess::Move& move):
+        move(move) {}
+};
+
 class SearchAgent {
 public:
+    // History scores are pulled towards zero as they grow, so they never leave [-MAX_HISTORY, MAX_HISTORY]
+    static constexpr int MAX_HISTORY = 8192;
+    // Singular extensions need a deep enough TT entry to be worth the extra search
+    static constexpr int SINGULAR_MIN_DEPTH = 6;
+
     TT* tt;
     KillerMoves killer_moves;
     int history_scores[chess::MAX_SQ][chess::MAX_SQ];
+    // The quiet move that last refuted each move, indexed by the piece moved and its destination
+    chess::Move counter_moves[12][chess::MAX_SQ];
+    // How quiet moves did when following the moves one and two plies earlier
+    ContinuationHistory continuation_histories[2];
+    CaptureHistory capture_history;
 
     SearchAgent(TT* tt):
         tt(tt) {
         memset(killer_moves, 0, sizeof killer_moves);
         memset(history_scores, 0, sizeof history_scores);
+        memset(counter_moves, 0, sizeof counter_moves);
+        memset(continuation_histories, 0, sizeof continuation_histories);
+        memset(capture_history, 0, sizeof capture_history);
     }
 
-    int search(nnue::Board& board, int alpha, int beta, SearchInfo& info, std::function<bool(int)> is_stopping) {
-        int score = alpha_beta(board, alpha, beta, info.starting_depth - 1, info, is_stopping);
-        return score;
+    // Agents live for the whole game, so move ordering knowledge is carried over between
+    // iterations and decayed between moves rather than thrown away
+    void new_search(bool new_game = false) {
+        // Killers are indexed by distance from the root, which changes with every search
+        memset(killer_moves, 0, sizeof killer_moves);
+        if (new_game) {
+            memset(history_scores, 0, sizeof history_scores);
+            memset(counter_moves, 0, sizeof counter_moves);
+            memset(continuation_histories, 0, sizeof continuation_histories);
+            memset(capture_history, 0, sizeof capture_history);
+        } else {
+            for (auto& from : history_scores) {
+                for (auto& score : from) {
+                    score >>= 1;
+                }
+            }
+            int16_t* continuation_scores = (int16_t*) continuation_histories;
+            for (size_t i = 0; i < sizeof continuation_histories / sizeof(int16_t); ++i) {
+                continuation_scores[i] >>= 1;
+            }
+            int16_t* capture_scores = (int16_t*) capture_history;
+            for (size_t i = 0; i < sizeof capture_history / sizeof(int16_t); ++i) {
+                capture_scores[i] >>= 1;
+            }
+        }
     }
 
+    // Root moves in the order the move picker would hand them out
+    std::vector<RootMove> get_root_moves(const chess::Board& board) const;
+
+    // Runs one iteration of iterative deepening, widening the aspiration window around the last
+    // score until the result falls inside it. The best line found ends up at the front of root_moves,
+    // even if the search is stopped partway through
+    int search_root(nnue::Board& board, std::vector<RootMove>& root_moves, SearchInfo& info, int last_score, bool full_window, uint8_t multipv, const StopCondition& stop);
+
 protected:
-    int alpha_beta(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, std::function<bool(int)> is_stopping, bool do_null_move = true, bool do_lmr = true);
-    int quiesce(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, std::function<bool(int)> is_stopping);
+    // The move made at each ply of the line being searched, and the piece that made it
+    struct PlyMove {
+        chess::Move move;
+        chess::Piece piece;
+    };
+    PlyMove search_stack[1024];
+
+    int alpha_beta_root(nnue::Board& board, std::vector<RootMove>& root_moves, int alpha, int beta, SearchInfo& info, const StopCondition& stop, uint8_t multipv);
+    // If excluded_move is set, the search leaves it out (for singular extensions) and doesn't touch the TT
+    int alpha_beta(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, const StopCondition& stop, bool do_null_move = true, bool do_lmr = true, const chess::Move& excluded_move = chess::Move(0));
+    int quiesce(nnue::Board& board, int alpha, int beta, int depth, SearchInfo& info, const StopCondition& stop);
 
     void add_killer_move(const chess::Move& move, chess::Color color, int ply);
     bool is_killer_move(const chess::Move& move, chess::Color color, int ply) const;
 
     int get_history_score(const chess::Move& move) const;
-    void update_history_score(const chess::Move& move, int depth);
+
+    // Points at the continuation histories of the moves one and two plies before ply,
+    // or null where there's no such move (at the root, or after a null move)
+    void get_continuation_histories(int ply, PieceToHistory* (&ret)[2]);
+    chess::Move get_counter_move(int ply) const;
+
+    static int history_bonus(int depth) {
+        return std::min(16 * depth * depth, MAX_HISTORY / 4);
+    }
+
+    // The closer a score already is to the bound, the less a bonus in the same direction moves it
+    template <typename T>
+    static void update_history(T& score, int bonus) {
+        score += bonus - score * std::abs(bonus) / MAX_HISTORY;
+    }
+
+    // Rewards a quiet move that caused a cutoff and punishes the quiets searched before it
+    void update_quiet_histories(const chess::Board& board, const chess::Move& move, const chess::Movelist& quiets_searched, int depth, int ply);
+    void update_capture_history(const chess::Board& board, const chess::Move& move, int bonus);
 };
 
 std::vector<chess::Move> get_pv(chess::Board board, const TT& tt);
+
+// Puts the best lines of the last iteration first, followed by the other moves ordered by their subtree sizes
+void sort_root_moves(std::vector<RootMove>& root_moves);
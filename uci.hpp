@@ -3,6 +3,8 @@
 #include "chess.hpp"
 #include "util.hpp"
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -27,12 +29,20 @@ namespace uci {
 
     inline PollResult poll() {
         std::string line;
-        std::getline(std::cin, line);
+        if (!std::getline(std::cin, line)) {
+            // The GUI has gone away, so there's nothing left to do
+            return PollResult {
+                .command = "quit",
+            };
+        }
         chess::utils::trim(line);
 
         logger.debug("Got UCI message: " + line);
 
         std::vector<std::string> line_split = chess::utils::splitString(line, ' ');
+        if (line_split.empty()) {
+            return PollResult {};
+        }
 
         std::string command = line_split[0];
         line_split.erase(line_split.begin());
@@ -56,6 +66,10 @@ namespace uci {
             }
         }
         logger.debug("Sent UCI command: " + ss.str());
+
+        // Messages are sent from the main loop as well as the search, so whole messages are written at once
+        static std::mutex mtx;
+        std::lock_guard<std::mutex> lock(mtx);
         std::cout << ss.str() << std::endl;
     }
 
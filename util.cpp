@@ -1,4 +1,7 @@
 #include "util.hpp"
+#include <boost/thread.hpp>
+#include <chrono>
+#include <stdexcept>
 
 ADD_INCR_OPERATORS_FOR(chess::PieceType);
 
@@ -36,3 +39,160 @@ chess::Bitboard attackers_for_side(const chess::Board& board, chess::Square sq,
     attackers |= chess::movegen::attacks::pawn(~attacker_color, sq) & attacking_pawns;
     return attackers;
 }
+
+// Walks every position up to the given depth (including null moves) and checks
+// the incrementally updated hash against a full recomputation, returning the number of positions checked
+unsigned long long verify_hash(chess::Board& board, int depth) {
+    if (board.hash() != board.zobrist()) {
+        throw std::logic_error("Incremental hash mismatch in position " + board.getFen());
+    }
+
+    if (depth == 0) {
+        return 1;
+    }
+
+    unsigned long long ret = 1;
+
+    if (!board.inCheck()) {
+        board.makeNullMove();
+        if (board.hash() != board.zobrist()) {
+            throw std::logic_error("Incremental hash mismatch after null move in position " + board.getFen());
+        }
+        board.unmakeNullMove();
+    }
+
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, board);
+    for (const auto& move : moves) {
+        board.makeMove(move);
+        ret += verify_hash(board, depth - 1);
+        board.unmakeMove(move);
+    }
+
+    if (board.hash() != board.zobrist()) {
+        throw std::logic_error("Incremental hash mismatch after unmaking moves in position " + board.getFen());
+    }
+    return ret;
+}
+
+// Runs make/unmake cycles over every two ply line from the given position, calling visit on
+// every position reached and returning the number of cycles per second
+template <typename Board, typename Visit>
+static double run_make_unmake(Board& board, unsigned long long cycles, Visit visit) {
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, board);
+    if (moves.empty()) {
+        throw std::invalid_argument("Position has no legal moves");
+    }
+
+    std::vector<chess::Movelist> replies(moves.size());
+    for (int i = 0; i < moves.size(); ++i) {
+        board.makeMove(moves[i]);
+        chess::movegen::legalmoves(replies[i], board);
+        board.unmakeMove(moves[i]);
+    }
+
+    unsigned long long completed = 0;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    while (completed < cycles) {
+        for (int i = 0; i < moves.size(); ++i) {
+            board.makeMove(moves[i]);
+            visit(board);
+            for (const auto& reply : replies[i]) {
+                board.makeMove(reply);
+                visit(board);
+                board.unmakeMove(reply);
+            }
+            board.unmakeMove(moves[i]);
+            completed += replies[i].size() + 1;
+        }
+    }
+    std::chrono::duration<double> time_elapsed = std::chrono::steady_clock::now() - start_time;
+    return completed / time_elapsed.count();
+}
+
+double bench_make_unmake(chess::Board board, unsigned long long cycles) {
+    volatile chess::U64 sink = 0;
+    return run_make_unmake(board, cycles, [&sink](const chess::Board& board) {
+        sink = sink ^ board.hash();
+    });
+}
+
+double bench_make_unmake(nnue::Board board, unsigned long long cycles, bool evaluate) {
+    volatile chess::U64 sink = 0;
+    if (evaluate) {
+        return run_make_unmake(board, cycles, [&sink](const nnue::Board& board) {
+            sink = sink + board.evaluate();
+        });
+    } else {
+        return run_make_unmake(board, cycles, [&sink](const nnue::Board& board) {
+            sink = sink ^ board.hash();
+        });
+    }
+}
+
+static unsigned long long perft(chess::Board& board, int depth, PerftTable* table) {
+    unsigned long long ret;
+    if (depth > 1 && table && table->probe(board.hash(), depth, ret)) {
+        return ret;
+    }
+
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, board);
+
+    // Bulk counting: the leaves don't need to be made
+    if (depth == 1) {
+        return moves.size();
+    }
+
+    ret = 0;
+    for (const auto& move : moves) {
+        board.makeMove(move);
+        ret += perft(board, depth - 1, table);
+        board.unmakeMove(move);
+    }
+
+    if (table) {
+        table->insert(board.hash(), depth, ret);
+    }
+    return ret;
+}
+
+std::vector<std::pair<chess::Move, unsigned long long>> perft(const chess::Board& board, int depth, int threads, size_t hash_size) {
+    if (depth < 1) {
+        throw std::invalid_argument("Perft depth must be at least 1");
+    }
+
+    chess::Movelist moves;
+    chess::movegen::legalmoves(moves, board);
+
+    std::vector<std::pair<chess::Move, unsigned long long>> ret;
+    for (const auto& move : moves) {
+        ret.emplace_back(move, 1);
+    }
+    if (depth == 1) {
+        return ret;
+    }
+
+    std::unique_ptr<PerftTable> table;
+    if (hash_size) {
+        table = std::make_unique<PerftTable>(hash_size * 1'000'000 / (sizeof(chess::U64) * 2));
+    }
+
+    // Threads take root moves one at a time, so a few large subtrees can't leave the rest idle
+    boost::atomic<int> next_move(0);
+    boost::thread_group thread_group;
+    for (int i = 0; i < std::max(threads, 1); ++i) {
+        thread_group.create_thread([&board, depth, &table, &next_move, &ret]() {
+            chess::Board thread_board = board;
+            for (int i; (i = next_move.fetch_add(1, boost::memory_order_relaxed)) < (int) ret.size();) {
+                thread_board.makeMove(ret[i].first);
+                ret[i].second = perft(thread_board, depth - 1, table.get());
+                thread_board.unmakeMove(ret[i].first);
+            }
+        });
+    }
+    thread_group.join_all();
+
+    return ret;
+}
@@ -2,10 +2,23 @@
 
 #include "chess.hpp"
 #include "logger.hpp"
-#include <prophet.h>
+#include "nnue.hpp"
+#include <boost/atomic.hpp>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #define BOTH_COLORS for (chess::Color color = chess::Color::WHITE; color != chess::Color::WHITE; color = ~color)
 
+// Build with -DORCA_DEBUG to check the incrementally updated hash against a full recomputation at every node
+#ifdef ORCA_DEBUG
+    #define ORCA_VERIFY_HASH(board) assert((board).hash() == (board).zobrist())
+#else
+    #define ORCA_VERIFY_HASH(board)
+#endif
+
 extern Logger logger;
 
 enum GameProgress {
@@ -18,3 +31,54 @@ GameProgress get_progress(int mv1, int mv2);
 bool has_non_pawn_material(const chess::Board& board, chess::Color color);
 
 chess::Bitboard attackers_for_side(const chess::Board& board, chess::Square sq, chess::Color attacker_color, chess::Bitboard occ);
+
+unsigned long long verify_hash(chess::Board& board, int depth);
+
+// Make/unmake cycles per second over every two ply line from the given position
+double bench_make_unmake(chess::Board board, unsigned long long cycles);
+double bench_make_unmake(nnue::Board board, unsigned long long cycles, bool evaluate = true);
+
+// Caches subtree leaf counts during perft. Each entry stores its key XORed with its
+// count, so a torn write from another thread just reads back as a miss
+class PerftTable {
+public:
+    PerftTable(size_t size):
+        entries(new Entry[size]),
+        size(size) {
+        for (size_t i = 0; i < size; ++i) {
+            entries[i].check.store(0, boost::memory_order_relaxed);
+            entries[i].count.store(0, boost::memory_order_relaxed);
+        }
+    }
+
+    bool probe(chess::U64 hash, int depth, unsigned long long& count) const {
+        chess::U64 key = key_of(hash, depth);
+        const Entry& entry = entries[key % size];
+        count = entry.count.load(boost::memory_order_relaxed);
+        return count && (entry.check.load(boost::memory_order_relaxed) ^ count) == key;
+    }
+
+    void insert(chess::U64 hash, int depth, unsigned long long count) {
+        chess::U64 key = key_of(hash, depth);
+        Entry& entry = entries[key % size];
+        entry.check.store(key ^ count, boost::memory_order_relaxed);
+        entry.count.store(count, boost::memory_order_relaxed);
+    }
+
+protected:
+    struct Entry {
+        boost::atomic<chess::U64> check;
+        boost::atomic<unsigned long long> count;
+    };
+
+    std::unique_ptr<Entry[]> entries;
+    size_t size;
+
+    static chess::U64 key_of(chess::U64 hash, int depth) {
+        return hash ^ (depth * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+// Counts the leaf nodes below each root move, splitting the root moves across threads.
+// hash_size is in megabytes, and 0 disables the perft hash table
+std::vector<std::pair<chess::Move, unsigned long long>> perft(const chess::Board& board, int depth, int threads = 1, size_t hash_size = 0);